@@ -0,0 +1,117 @@
+/**
+ * parse_url_bench.c
+ *
+ * Microbenchmark of the mod_image_resize URL parser. Compares the
+ * single-pass parser with the former per-request regcomp()/regexec()
+ * implementation, and checks that both accept the same URLs.
+ *
+ * Usage: parse_url_bench [iterations]
+ */
+
+#include "../image_resize_url.h"
+
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *urls[] = {
+    "/resized/640x480/path/to/image.jpg",
+    "/resized/150x150/a.png",
+    "/resized/1200x800/some/deeply/nested/directory/structure/photo.webp",
+    "/resized/10x10/100x100/animated.gif",
+    "/resized/400x300/no_extension",
+    "/resized/400x/missing_height.jpg",
+    "/resized/99999999999x1/overflow.jpg",
+    "/resized/0x300/zero.jpg",
+    "/resized/320x240/archive.tar.gz",
+    "/resized/320x240/.hidden",
+};
+
+#define URL_COUNT (sizeof(urls) / sizeof(urls[0]))
+
+// Former implementation: compile the regex on every call
+static int legacy_parse_url(const char *url, int *width, int *height) {
+    regex_t regex;
+    regmatch_t matches[4];
+    char width_str[10] = {0};
+    char height_str[10] = {0};
+    size_t len;
+
+    if (regcomp(&regex, "/([0-9]+)x([0-9]+)/(.+\\.[^\\/]+)$", REG_EXTENDED)) {
+        return -1;
+    }
+    if (regexec(&regex, url, 4, matches, 0) != 0) {
+        regfree(&regex);
+        return -1;
+    }
+
+    len = matches[1].rm_eo - matches[1].rm_so;
+    if (len >= sizeof(width_str)) len = sizeof(width_str) - 1;
+    strncpy(width_str, url + matches[1].rm_so, len);
+    *width = atoi(width_str);
+
+    len = matches[2].rm_eo - matches[2].rm_so;
+    if (len >= sizeof(height_str)) len = sizeof(height_str) - 1;
+    strncpy(height_str, url + matches[2].rm_so, len);
+    *height = atoi(height_str);
+
+    regfree(&regex);
+    return 0;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    volatile int sink = 0;
+    double start, parser_ns, legacy_ns;
+    size_t i;
+    long n;
+
+    // Both parsers must agree, except where the new one rejects zero or
+    // overflowing dimensions that the regex accepted
+    for (i = 0; i < URL_COUNT; i++) {
+        image_request req;
+        int width = 0, height = 0;
+        int parsed = image_resize_parse_url(urls[i], &req) == 0;
+        int legacy = legacy_parse_url(urls[i], &width, &height) == 0;
+
+        printf("%-70s parser=%s", urls[i], parsed ? "ok" : "rejected");
+        if (parsed) {
+            printf(" %dx%d %s %s", req.width, req.height, req.filename, image_format_name(req.format));
+        }
+        printf(" legacy=%s\n", legacy ? "ok" : "rejected");
+
+        if (parsed && (!legacy || width != req.width || height != req.height)) {
+            fprintf(stderr, "mismatch on %s\n", urls[i]);
+            return 1;
+        }
+    }
+
+    start = now_ns();
+    for (n = 0; n < iterations; n++) {
+        image_request req;
+        sink += image_resize_parse_url(urls[n % URL_COUNT], &req);
+    }
+    parser_ns = (now_ns() - start) / iterations;
+
+    start = now_ns();
+    for (n = 0; n < iterations; n++) {
+        int width, height;
+        sink += legacy_parse_url(urls[n % URL_COUNT], &width, &height);
+    }
+    legacy_ns = (now_ns() - start) / iterations;
+
+    printf("\n%ld iterations over %zu URLs\n", iterations, URL_COUNT);
+    printf("single-pass parser: %10.1f ns/URL\n", parser_ns);
+    printf("regcomp per call:   %10.1f ns/URL\n", legacy_ns);
+    printf("speedup:            %10.1fx\n", legacy_ns / parser_ns);
+
+    return sink == 42 ? 2 : 0;
+}
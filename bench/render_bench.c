@@ -0,0 +1,526 @@
+/**
+ * render_bench.c
+ *
+ * Benchmark of the mod_image_resize render pipeline, without Apache. Drives
+ * image_resize_process_image() and image_resize_parse_url() from N threads
+ * and reports throughput, latency percentiles, the average time of each
+ * render phase and the peak RSS of each run.
+ *
+ * Two modes:
+ * - synthetic (default): generates a corpus of sources of several sizes and
+ *   formats, then renders every requested size of them in each output
+ *   format and quality;
+ * - replay (-r): replays the /WIDTHxHEIGHT/path URLs of an access log
+ *   against the sources of -d, with a cold (empty) or warm (-W) cache
+ *   in the tree layout of the module, the first -q quality standing for
+ *   ImageResizeQuality. The rows of each output format share the run, so
+ *   they report no throughput nor RSS of their own.
+ *
+ * Usage: render_bench [-d sourcedir] [-c cachedir] [-t threads] [-n renders]
+ *                     [-f jpg,png,webp,avif,gif] [-q 60,75,90]
+ *                     [-s 150x150,400x300,...] [-j vipsthreads]
+ *                     [-r accesslog [-W]] [-F] [-v]
+ *
+ * -F encodes at the lowest effort, like the first tier of
+ * ImageResizeTwoTierEncode.
+ */
+
+#include "../image_resize_render.h"
+
+#include <apr_general.h>
+#include <apr_atomic.h>
+#include <apr_thread_proc.h>
+#include <vips/vips.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+// Sources of the synthetic corpus
+static const image_resize_size corpus_sizes[] = {
+    { 800, 600 }, { 2048, 1536 }, { 4032, 3024 }
+};
+static const char *const corpus_formats[] = { "jpg", "png", "webp" };
+
+#define CORPUS_SIZES (sizeof(corpus_sizes) / sizeof(corpus_sizes[0]))
+#define CORPUS_FORMATS (sizeof(corpus_formats) / sizeof(corpus_formats[0]))
+
+// One render or cache lookup of a run
+typedef struct {
+    image_request req;           // What to render
+    const char *output_path;     // Cache file
+    apr_interval_time_t latency; // Time taken, in microseconds
+    int status;                  // Result of the render
+    int hit;                     // Served from the cache
+    image_render_timings timings;
+} bench_job;
+
+// A set of jobs run by the worker threads
+typedef struct {
+    const image_resize_config *cfg;
+    bench_job *jobs;
+    apr_uint32_t njobs;
+    volatile apr_uint32_t next;  // Next job to take
+    int use_cache;               // Look the output up before rendering it
+    int render_flags;            // IMAGE_RENDER_* flags of the renders
+} bench_run;
+
+static int verbose = 0;
+
+static void bench_log(const image_render_ctx *ctx, int level, const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+}
+
+// Peak RSS of the process in kB, since the last bench_reset_peak_rss()
+static long bench_peak_rss(void) {
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "VmHWM:", 6) == 0) {
+                kb = atol(line + 6);
+                break;
+            }
+        }
+        fclose(f);
+    }
+    if (kb < 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        kb = usage.ru_maxrss;
+    }
+    return kb;
+}
+
+// Reset the peak RSS to the current RSS (Linux only, else the peak is global)
+static void bench_reset_peak_rss(void) {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+static void * APR_THREAD_FUNC bench_worker(apr_thread_t *thread, void *data) {
+    bench_run *run = data;
+    image_render_ctx ctx;
+    apr_pool_t *pool;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return NULL;
+    }
+    ctx.log = bench_log;
+    ctx.log_data = NULL;
+    ctx.log_level = verbose ? RENDER_LOG_DEBUG : RENDER_LOG_WARNING;
+    ctx.background = 1;
+
+    for (;;) {
+        apr_uint32_t i = apr_atomic_inc32(&run->next);
+        bench_job *job;
+        apr_finfo_t finfo;
+        apr_time_t start;
+
+        if (i >= run->njobs) {
+            break;
+        }
+        job = &run->jobs[i];
+        ctx.pool = pool;
+        ctx.timings = &job->timings;
+
+        start = image_resize_clock();
+        if (run->use_cache && apr_stat(&finfo, job->output_path, APR_FINFO_SIZE, pool) == APR_SUCCESS) {
+            // A hit reads the cache file, as the handler does before sending it
+            apr_file_t *fd;
+            char *buf = apr_palloc(pool, finfo.size > 0 ? finfo.size : 1);
+            job->status = apr_file_open(&fd, job->output_path, APR_READ, APR_OS_DEFAULT, pool);
+            if (job->status == APR_SUCCESS) {
+                job->status = apr_file_read_full(fd, buf, finfo.size, NULL);
+                apr_file_close(fd);
+            }
+            job->hit = 1;
+        } else {
+            job->status = image_resize_process_image(&ctx, run->cfg, &job->req, job->output_path,
+                                                     run->render_flags, NULL);
+        }
+        job->latency = image_resize_clock() - start;
+        apr_pool_clear(pool);
+    }
+
+    image_resize_render_thread_done();
+    apr_pool_destroy(pool);
+    return NULL;
+}
+
+// Run all the jobs on the given number of threads, returns the wall time
+static apr_interval_time_t bench_execute(bench_run *run, int nthreads, apr_pool_t *p) {
+    apr_thread_t **threads = apr_pcalloc(p, nthreads * sizeof(apr_thread_t *));
+    apr_time_t start = image_resize_clock();
+    int i;
+
+    run->next = 0;
+    for (i = 0; i < nthreads; i++) {
+        if (apr_thread_create(&threads[i], NULL, bench_worker, run, p) != APR_SUCCESS) {
+            threads[i] = NULL;
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        apr_status_t rv;
+        if (threads[i]) {
+            apr_thread_join(&rv, threads[i]);
+        }
+    }
+    return image_resize_clock() - start;
+}
+
+static int bench_compare_latency(const void *a, const void *b) {
+    apr_interval_time_t x = *(const apr_interval_time_t *)a;
+    apr_interval_time_t y = *(const apr_interval_time_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Print one line of results for the jobs of a run matching a format (or all, with -1)
+// Report the jobs of a run, or those of one output format. Rows of a format
+// pass a zero wall time and a negative RSS, which belong to the whole run.
+static void bench_report(const char *label, const bench_run *run, int format,
+                         apr_interval_time_t wall, long rss_kb, apr_pool_t *p) {
+    apr_interval_time_t *latencies = apr_palloc(p, run->njobs * sizeof(apr_interval_time_t));
+    apr_interval_time_t phases[IMAGE_PHASE_COUNT] = { 0 };
+    apr_uint32_t i, n = 0, hits = 0, failures = 0, renders = 0;
+    apr_uint64_t output_bytes = 0;
+
+    for (i = 0; i < run->njobs; i++) {
+        const bench_job *job = &run->jobs[i];
+        int phase;
+
+        if (format >= 0 && (int)job->req.format != format) {
+            continue;
+        }
+        latencies[n++] = job->latency;
+        hits += job->hit;
+        failures += job->status != 0;
+        if (!job->hit) {
+            renders++;
+            output_bytes += job->timings.output_bytes;
+            for (phase = 0; phase < IMAGE_PHASE_COUNT; phase++) {
+                phases[phase] += job->timings.phases[phase];
+            }
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    qsort(latencies, n, sizeof(apr_interval_time_t), bench_compare_latency);
+
+    printf("%-14s %6u %9s %8.2f %8.2f %8.2f %8.2f %5u %5u %8.2f %8.2f %8.2f %8lu %8s\n",
+           label, n, wall > 0 ? apr_psprintf(p, "%.1f", n / ((double)wall / APR_USEC_PER_SEC)) : "-",
+           latencies[n / 2] / 1000.0, latencies[n * 9 / 10] / 1000.0,
+           latencies[n * 99 / 100] / 1000.0, latencies[n - 1] / 1000.0,
+           hits, failures,
+           renders ? phases[IMAGE_PHASE_DECODE] / 1000.0 / renders : 0.0,
+           renders ? phases[IMAGE_PHASE_ENCODE] / 1000.0 / renders : 0.0,
+           renders ? phases[IMAGE_PHASE_WRITE] / 1000.0 / renders : 0.0,
+           (unsigned long)(renders ? output_bytes / renders : 0),
+           rss_kb >= 0 ? apr_ltoa(p, rss_kb) : "-");
+}
+
+static void bench_report_header(void) {
+    printf("%-14s %6s %9s %8s %8s %8s %8s %5s %5s %8s %8s %8s %8s %8s\n",
+           "run", "n", "req/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "hits", "fail",
+           "decode", "encode", "write", "bytes", "rss kB");
+}
+
+// Generate a source image: smoothed colour noise, which compresses like a photo
+static int bench_make_source(const char *path, int width, int height) {
+    VipsImage *bands[3] = { NULL, NULL, NULL };
+    VipsImage *joined = NULL, *blurred = NULL, *out = NULL;
+    int failed = 0;
+    int i;
+
+    for (i = 0; i < 3 && !failed; i++) {
+        failed = vips_gaussnoise(&bands[i], width, height, "mean", 128.0, "sigma", 60.0, NULL);
+    }
+    failed = failed || vips_bandjoin(bands, &joined, 3, NULL) ||
+             vips_gaussblur(joined, &blurred, 1.5, NULL) ||
+             vips_cast_uchar(blurred, &out, NULL) ||
+             vips_image_write_to_file(out, path, NULL);
+
+    for (i = 0; i < 3; i++) {
+        if (bands[i]) g_object_unref(bands[i]);
+    }
+    if (joined) g_object_unref(joined);
+    if (blurred) g_object_unref(blurred);
+    if (out) g_object_unref(out);
+
+    if (failed) {
+        fprintf(stderr, "cannot create %s: %s\n", path, vips_error_buffer());
+        vips_error_clear();
+    }
+    return failed ? -1 : 0;
+}
+
+// Parse "a,b,c" into an array of strings
+static apr_array_header_t *bench_split(apr_pool_t *p, const char *list) {
+    apr_array_header_t *items = apr_array_make(p, 4, sizeof(const char *));
+    char *last;
+    char *item = apr_strtok(apr_pstrdup(p, list), ",", &last);
+
+    while (item) {
+        APR_ARRAY_PUSH(items, const char *) = item;
+        item = apr_strtok(NULL, ",", &last);
+    }
+    return items;
+}
+
+// Extract the URL of an access log line: the path of the quoted request
+// line, or the whole line when it starts with a slash. The query is dropped.
+static char *bench_log_url(char *line) {
+    char *url = line;
+    char *end;
+
+    if (*line != '/') {
+        char *quote = strchr(line, '"');
+        if (!quote || !(url = strchr(quote, ' '))) {
+            return NULL;
+        }
+        url++;
+    }
+    end = url + strcspn(url, " ?\"\r\n");
+    *end = '\0';
+    return url;
+}
+
+// Read the URLs of an access log into jobs, with the cache paths the module
+// gives them under the configuration of the bench
+static apr_array_header_t *bench_read_log(apr_pool_t *p, const char *path,
+                                          const image_resize_config *cfg) {
+    apr_array_header_t *jobs = apr_array_make(p, 1024, sizeof(bench_job));
+    FILE *f = fopen(path, "r");
+    char line[4096];
+    long skipped = 0;
+
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *url = bench_log_url(line);
+        image_request req;
+        char options[IMAGE_RESIZE_OPTIONS_SIZE];
+        bench_job *job;
+
+        if (!url || image_resize_parse_url(url, &req) != 0) {
+            skipped++;
+            continue;
+        }
+        job = apr_array_push(jobs);
+        memset(job, 0, sizeof(bench_job));
+        job->req = req;
+        job->req.filename = apr_pstrdup(p, req.filename);
+        job->output_path = apr_psprintf(p, "%s/%dx%d%s_%s", cfg->cache_dir, req.width, req.height,
+                                        image_resize_canonical_options(&req, cfg->quality, options,
+                                                                       sizeof(options)),
+                                        job->req.filename);
+    }
+    fclose(f);
+
+    if (skipped) {
+        fprintf(stderr, "%ld lines without a resize URL skipped\n", skipped);
+    }
+    return jobs;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-d sourcedir] [-c cachedir] [-t threads] [-n renders]\n"
+            "          [-f jpg,png,webp,avif,gif] [-q 60,75,90] [-s 150x150,400x300,...]\n"
+            "          [-j vipsthreads] [-r accesslog [-W]] [-F] [-v]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *source_dir = NULL;
+    const char *cache_dir = NULL;
+    const char *formats = "jpg,webp,png,avif";
+    const char *qualities = "75";
+    const char *sizes = "150x150,400x300,1200x800";
+    const char *replay = NULL;
+    int nthreads = 4;
+    int nrenders = 200;
+    int warm = 0;
+    int fast = 0;
+    image_vips_tuning tuning = { 1, 0, -1, -1, 0 };
+    image_resize_config cfg;
+    apr_pool_t *pool;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:c:t:n:f:q:s:j:r:WFv")) != -1) {
+        switch (opt) {
+        case 'd': source_dir = optarg; break;
+        case 'c': cache_dir = optarg; break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'n': nrenders = atoi(optarg); break;
+        case 'f': formats = optarg; break;
+        case 'q': qualities = optarg; break;
+        case 's': sizes = optarg; break;
+        case 'j': tuning.concurrency = atoi(optarg); break;
+        case 'r': replay = optarg; break;
+        case 'W': warm = 1; break;
+        case 'F': fast = 1; break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (nthreads <= 0 || nrenders <= 0 || (replay && !source_dir)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    apr_initialize();
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+
+    // Renders are independent, like the requests of a server: no operation
+    // cache, and one libvips thread per render unless -j says otherwise
+    if (image_resize_render_init(argv[0], &tuning) != 0) {
+        fprintf(stderr, "cannot initialize libvips: %s\n", vips_error_buffer());
+        return 1;
+    }
+
+    if (!cache_dir) {
+        char *dir = apr_pstrdup(pool, "/tmp/render_bench_cache.XXXXXX");
+        if (!mkdtemp(dir)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        cache_dir = dir;
+    }
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.cache_dir = cache_dir;
+    cfg.quality = 75;
+    cfg.cache_layout = IMAGE_CACHE_LAYOUT_TREE;
+    cfg.png_effort = 9;
+    cfg.webp_effort = 4;
+
+    bench_report_header();
+
+    // Replay an access log against the cache, optionally warmed by a first pass
+    if (replay) {
+        apr_array_header_t *jobs;
+        bench_run run;
+        apr_interval_time_t wall;
+        int format;
+
+        cfg.image_dir = source_dir;
+        cfg.quality = atoi(qualities);
+        jobs = bench_read_log(pool, replay, &cfg);
+        if (!jobs || jobs->nelts == 0) {
+            fprintf(stderr, "no URL to replay\n");
+            return 1;
+        }
+        run.cfg = &cfg;
+        run.jobs = (bench_job *)jobs->elts;
+        run.njobs = jobs->nelts;
+        run.use_cache = 1;
+        run.render_flags = fast ? IMAGE_RENDER_FAST_ENCODE : 0;
+
+        if (warm) {
+            int i;
+            bench_execute(&run, nthreads, pool);
+            for (i = 0; i < jobs->nelts; i++) {
+                run.jobs[i].hit = 0;
+                run.jobs[i].status = 0;
+                memset(&run.jobs[i].timings, 0, sizeof(image_render_timings));
+            }
+        }
+
+        bench_reset_peak_rss();
+        wall = bench_execute(&run, nthreads, pool);
+        bench_report(warm ? "replay warm" : "replay cold", &run, -1, wall, bench_peak_rss(), pool);
+        for (format = IMAGE_FORMAT_JPEG; format <= IMAGE_FORMAT_AVIF; format++) {
+            bench_report(apr_psprintf(pool, "  %s", image_format_name(format)), &run, format,
+                         0, -1, pool);
+        }
+        printf("\ncache: %s\n", cache_dir);
+        return 0;
+    }
+
+    // Synthetic corpus, generated once into the source directory
+    apr_array_header_t *sources = apr_array_make(pool, 16, sizeof(const char *));
+    apr_array_header_t *format_list = bench_split(pool, formats);
+    apr_array_header_t *quality_list = bench_split(pool, qualities);
+    apr_array_header_t *size_list = bench_split(pool, sizes);
+    size_t s, f;
+    int i, j, k;
+
+    if (!source_dir) {
+        source_dir = apr_pstrcat(pool, cache_dir, "/corpus", NULL);
+    }
+    apr_dir_make_recursive(source_dir, APR_OS_DEFAULT, pool);
+    for (s = 0; s < CORPUS_SIZES; s++) {
+        for (f = 0; f < CORPUS_FORMATS; f++) {
+            const char *name = apr_psprintf(pool, "synthetic_%dx%d.%s", corpus_sizes[s].width,
+                                            corpus_sizes[s].height, corpus_formats[f]);
+            const char *path = apr_pstrcat(pool, source_dir, "/", name, NULL);
+            apr_finfo_t finfo;
+
+            if (apr_stat(&finfo, path, APR_FINFO_TYPE, pool) != APR_SUCCESS &&
+                bench_make_source(path, corpus_sizes[s].width, corpus_sizes[s].height) != 0) {
+                return 1;
+            }
+            APR_ARRAY_PUSH(sources, const char *) = name;
+        }
+    }
+    cfg.image_dir = source_dir;
+
+    // One run per output format and quality, cycling through sources and sizes
+    for (i = 0; i < format_list->nelts; i++) {
+        const char *format_name = APR_ARRAY_IDX(format_list, i, const char *);
+        image_format format = image_format_from_filename(apr_pstrcat(pool, ".", format_name, NULL));
+
+        if (format == IMAGE_FORMAT_UNKNOWN) {
+            fprintf(stderr, "unknown format %s\n", format_name);
+            return 2;
+        }
+        for (j = 0; j < quality_list->nelts; j++) {
+            bench_run run;
+            apr_interval_time_t wall;
+
+            cfg.quality = atoi(APR_ARRAY_IDX(quality_list, j, const char *));
+            run.cfg = &cfg;
+            run.njobs = nrenders;
+            run.use_cache = 0;
+            run.render_flags = fast ? IMAGE_RENDER_FAST_ENCODE : 0;
+            run.jobs = apr_pcalloc(pool, nrenders * sizeof(bench_job));
+
+            for (k = 0; k < nrenders; k++) {
+                bench_job *job = &run.jobs[k];
+                const char *size = APR_ARRAY_IDX(size_list, k % size_list->nelts, const char *);
+                const char *source = APR_ARRAY_IDX(sources, (k / size_list->nelts) % sources->nelts,
+                                                   const char *);
+
+                if (sscanf(size, "%dx%d", &job->req.width, &job->req.height) != 2 ||
+                    job->req.width <= 0 || job->req.height <= 0) {
+                    fprintf(stderr, "invalid size %s\n", size);
+                    return 2;
+                }
+                job->req.filename = source;
+                job->req.format = format;
+                job->output_path = apr_psprintf(pool, "%s/%s_q%d/%s_%s.%s", cache_dir, format_name,
+                                                cfg.quality, size, source, format_name);
+            }
+
+            bench_reset_peak_rss();
+            wall = bench_execute(&run, nthreads, pool);
+            bench_report(apr_psprintf(pool, "%s q%d", format_name, cfg.quality), &run, -1,
+                         wall, bench_peak_rss(), pool);
+        }
+    }
+
+    printf("\n%d threads, %d renders per run, sources and outputs in %s\n",
+           nthreads, nrenders, cache_dir);
+    return 0;
+}
@@ -0,0 +1,436 @@
+/**
+ * image_resize_janitor.c
+ *
+ * Size limit of the disk cache. Requests record the hits and misses of the
+ * cache, and the last access of each entry, in a small table shared by all
+ * children. One child, elected with a global mutex, walks the cache
+ * directories every ImageResizeCacheJanitorInterval seconds in the background and removes the coldest entries of
+ * those over their ImageResizeCacheMaxBytes budget.
+ */
+
+#include "mod_image_resize.h"
+#include <apr_atomic.h>
+#include <apr_thread_proc.h>
+
+// Number of slots of the shared table of last accesses
+#define JANITOR_ACCESS_SLOTS 65536
+
+// Entries considered for eviction by a walk: the coldest ones seen
+#define JANITOR_CANDIDATES 4096
+
+// After an eviction, the cache is brought down to this share of its budget
+#define JANITOR_LOW_WATER_PERCENT 90
+
+// Temporary files older than this are leftovers of a crashed render
+#define JANITOR_TEMP_MAX_AGE apr_time_from_sec(3600)
+
+// Mutex type electing the janitor, configurable with the Mutex directive
+static const char *janitor_mutex_type = "image-resize-janitor";
+
+// Counters and access times shared by all children
+typedef struct {
+    volatile apr_uint64_t hits;      // Requests served from the cache
+    volatile apr_uint64_t misses;    // Requests which rendered their image
+    volatile apr_uint64_t evictions; // Cache entries removed by the janitor
+    // Last access of each entry: hash of the cache path in the high 32 bits,
+    // seconds since the epoch in the low 32 bits. Single 64-bit stores, so
+    // a reader never sees a time paired with another entry's hash.
+    volatile apr_uint64_t access[JANITOR_ACCESS_SLOTS];
+} janitor_shared;
+
+// A cache directory with a size budget
+typedef struct {
+    const char *cache_dir;       // Cache directory
+    apr_off_t max_bytes;         // Budget (smallest of the configurations using it)
+} janitor_root;
+
+// A cache entry considered for eviction
+typedef struct {
+    char *path;                  // Cache file (malloc)
+    apr_off_t size;              // Size in bytes
+    apr_time_t used;             // Last known use
+} janitor_candidate;
+
+// Shared table and budgets, created before the children are forked
+static apr_shm_t *janitor_shm = NULL;
+static janitor_shared *janitor = NULL;
+static apr_global_mutex_t *janitor_mutex = NULL;
+static apr_array_header_t *janitor_roots = NULL;
+static apr_interval_time_t janitor_interval = 0; // Delay between two walks
+
+// Per-child state of the janitor thread
+static struct {
+    server_rec *server;          // Server the janitor logs to
+    apr_thread_mutex_t *mutex;   // Protects the stop flag
+    apr_thread_cond_t *wakeup;   // Signalled on shutdown
+    int stopping;                // Set when the child shuts down
+    apr_thread_t *thread;
+} janitor_state;
+
+// Register the mutex type of the janitor election - called from pre_config
+apr_status_t image_resize_janitor_pre_config(apr_pool_t *p) {
+    return ap_mutex_register(p, janitor_mutex_type, NULL, APR_LOCK_DEFAULT, 0);
+}
+
+// Create the shared counters, and collect the cache budgets of all servers -
+// called from post_config, before forking
+apr_status_t image_resize_janitor_create(apr_pool_t *p, server_rec *s) {
+    image_resize_server_config *main_scfg = ap_get_module_config(s->module_config,
+                                                                 &image_resize_module);
+    server_rec *vs;
+    apr_status_t rv;
+    int i, j;
+
+    janitor = NULL;
+    janitor_mutex = NULL;
+    janitor_roots = apr_array_make(p, 1, sizeof(janitor_root));
+    janitor_interval = apr_time_from_sec(main_scfg->janitor_interval);
+
+    rv = apr_shm_create(&janitor_shm, sizeof(janitor_shared), NULL, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to create cache statistics shared memory");
+        return rv;
+    }
+    janitor = apr_shm_baseaddr_get(janitor_shm);
+    memset(janitor, 0, sizeof(janitor_shared));
+
+    for (vs = s; vs; vs = vs->next) {
+        image_resize_server_config *scfg = ap_get_module_config(vs->module_config,
+                                                                &image_resize_module);
+        for (i = 0; i < scfg->janitor_configs->nelts; i++) {
+            image_resize_config *cfg = APR_ARRAY_IDX(scfg->janitor_configs, i, image_resize_config *);
+            janitor_root *root = NULL;
+
+            if (!cfg->cache_dir) {
+                continue;
+            }
+            for (j = 0; j < janitor_roots->nelts; j++) {
+                if (strcmp(APR_ARRAY_IDX(janitor_roots, j, janitor_root).cache_dir, cfg->cache_dir) == 0) {
+                    root = &APR_ARRAY_IDX(janitor_roots, j, janitor_root);
+                    break;
+                }
+            }
+            if (!root) {
+                root = apr_array_push(janitor_roots);
+                root->cache_dir = cfg->cache_dir;
+                root->max_bytes = cfg->cache_max_bytes;
+            } else if (cfg->cache_max_bytes < root->max_bytes) {
+                root->max_bytes = cfg->cache_max_bytes;
+            }
+        }
+    }
+
+    if (janitor_roots->nelts == 0) {
+        return APR_SUCCESS;
+    }
+
+    rv = ap_global_mutex_create(&janitor_mutex, NULL, janitor_mutex_type, NULL, s, p, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to create cache janitor mutex");
+        return rv;
+    }
+
+    return APR_SUCCESS;
+}
+
+// Record a request served from the cache (hit) or rendered (miss)
+void image_resize_janitor_record(const char *cache_path, int hit) {
+    apr_uint32_t hash;
+
+    if (!janitor) {
+        return;
+    }
+
+    apr_atomic_inc64(hit ? &janitor->hits : &janitor->misses);
+
+    hash = image_resize_hash_string(cache_path);
+    janitor->access[hash % JANITOR_ACCESS_SLOTS] =
+        ((apr_uint64_t)hash << 32) | (apr_uint32_t)apr_time_sec(apr_time_now());
+}
+
+// Read the counters of the cache
+void image_resize_janitor_stats(apr_uint64_t *hits, apr_uint64_t *misses, apr_uint64_t *evictions) {
+    *hits = janitor ? apr_atomic_read64(&janitor->hits) : 0;
+    *misses = janitor ? apr_atomic_read64(&janitor->misses) : 0;
+    *evictions = janitor ? apr_atomic_read64(&janitor->evictions) : 0;
+}
+
+// Last use of a cache entry: its last recorded access, or when it was written
+static apr_time_t janitor_last_use(const char *path, apr_time_t written) {
+    apr_uint32_t hash = image_resize_hash_string(path);
+    apr_uint64_t access = janitor->access[hash % JANITOR_ACCESS_SLOTS];
+
+    if ((apr_uint32_t)(access >> 32) == hash) {
+        apr_time_t accessed = apr_time_from_sec((apr_uint32_t)access);
+        return accessed > written ? accessed : written;
+    }
+    return written;
+}
+
+// Check if the child is shutting down
+static int janitor_stopping(void) {
+    int stopping;
+
+    apr_thread_mutex_lock(janitor_state.mutex);
+    stopping = janitor_state.stopping;
+    apr_thread_mutex_unlock(janitor_state.mutex);
+    return stopping;
+}
+
+// Sleep up to the given time, waking up early on shutdown
+static void janitor_sleep(apr_interval_time_t timeout) {
+    apr_thread_mutex_lock(janitor_state.mutex);
+    if (!janitor_state.stopping) {
+        apr_thread_cond_timedwait(janitor_state.wakeup, janitor_state.mutex, timeout);
+    }
+    apr_thread_mutex_unlock(janitor_state.mutex);
+}
+
+// State of a walk of a cache directory
+typedef struct {
+    apr_off_t total;             // Bytes found so far
+    apr_int64_t entries;         // Entries found so far
+    janitor_candidate heap[JANITOR_CANDIDATES]; // Coldest entries, warmest on top
+    int count;
+} janitor_walk;
+
+// Restore the heap order below a candidate
+static void janitor_sift_down(janitor_walk *walk, int i) {
+    for (;;) {
+        int warmest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < walk->count && walk->heap[l].used > walk->heap[warmest].used) warmest = l;
+        if (r < walk->count && walk->heap[r].used > walk->heap[warmest].used) warmest = r;
+        if (warmest == i) {
+            return;
+        }
+        janitor_candidate tmp = walk->heap[i];
+        walk->heap[i] = walk->heap[warmest];
+        walk->heap[warmest] = tmp;
+        i = warmest;
+    }
+}
+
+// Keep an entry if it is among the coldest seen so far
+static void janitor_consider(janitor_walk *walk, const char *path, apr_off_t size, apr_time_t used) {
+    int i;
+
+    if (walk->count == JANITOR_CANDIDATES) {
+        if (used >= walk->heap[0].used) {
+            return;
+        }
+        char *copy = strdup(path);
+        if (!copy) {
+            return;
+        }
+        free(walk->heap[0].path);
+        walk->heap[0].path = copy;
+        walk->heap[0].size = size;
+        walk->heap[0].used = used;
+        janitor_sift_down(walk, 0);
+        return;
+    }
+
+    char *copy = strdup(path);
+    if (!copy) {
+        return;
+    }
+    i = walk->count++;
+    walk->heap[i].path = copy;
+    walk->heap[i].size = size;
+    walk->heap[i].used = used;
+    // Sift up
+    while (i > 0 && walk->heap[(i - 1) / 2].used < walk->heap[i].used) {
+        janitor_candidate tmp = walk->heap[i];
+        walk->heap[i] = walk->heap[(i - 1) / 2];
+        walk->heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+}
+
+// Walk a directory of the cache, adding up sizes and keeping the coldest entries
+static void janitor_scan(janitor_walk *walk, const char *path, apr_pool_t *pool) {
+    apr_pool_t *scratch;
+    apr_dir_t *dir;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+    apr_time_t now = apr_time_now();
+
+    if (apr_pool_create(&scratch, pool) != APR_SUCCESS) {
+        return;
+    }
+    if (apr_dir_open(&dir, path, scratch) != APR_SUCCESS) {
+        apr_pool_destroy(scratch);
+        return;
+    }
+
+    while (!janitor_stopping()) {
+        rv = apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE | APR_FINFO_SIZE | APR_FINFO_CTIME, dir);
+        if (rv != APR_SUCCESS && rv != APR_INCOMPLETE) {
+            break;
+        }
+        if (strcmp(finfo.name, ".") == 0 || strcmp(finfo.name, "..") == 0) {
+            continue;
+        }
+        const char *child = apr_pstrcat(scratch, path, "/", finfo.name, NULL);
+        if (finfo.filetype == APR_DIR) {
+            janitor_scan(walk, child, pool);
+        } else if (finfo.filetype == APR_REG) {
+            size_t len = strlen(finfo.name);
+            if (len > 4 && strcmp(finfo.name + len - 4, ".tmp") == 0) {
+                // Leftover of a crashed render, or a render in progress
+                if (now - finfo.ctime > JANITOR_TEMP_MAX_AGE) {
+                    apr_file_remove(child, scratch);
+                }
+                continue;
+            }
+            // Cache files carry the mtime of their source: ctime is when they were written
+            walk->total += finfo.size;
+            walk->entries++;
+            janitor_consider(walk, child, finfo.size, janitor_last_use(child, finfo.ctime));
+        }
+    }
+
+    apr_dir_close(dir);
+    apr_pool_destroy(scratch);
+}
+
+// Order candidates from the coldest
+static int janitor_candidate_compare(const void *a, const void *b) {
+    apr_time_t ua = ((const janitor_candidate *)a)->used;
+    apr_time_t ub = ((const janitor_candidate *)b)->used;
+    return ua < ub ? -1 : ua > ub;
+}
+
+// Bring a cache directory under its budget. Returns 1 if it is still over
+// budget because more entries must be removed than a walk considers, so
+// that another walk follows at once.
+static int janitor_clean(const janitor_root *root, janitor_walk *walk, apr_pool_t *pool) {
+    apr_off_t low_water = root->max_bytes / 100 * JANITOR_LOW_WATER_PERCENT;
+    apr_uint32_t evicted = 0;
+    int i;
+
+    walk->total = 0;
+    walk->entries = 0;
+    walk->count = 0;
+    janitor_scan(walk, root->cache_dir, pool);
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, janitor_state.server,
+                "mod_image_resize: cache %s holds %" APR_INT64_T_FMT " entries, %" APR_OFF_T_FMT
+                " bytes of %" APR_OFF_T_FMT " allowed", root->cache_dir, walk->entries,
+                walk->total, root->max_bytes);
+
+    qsort(walk->heap, walk->count, sizeof(janitor_candidate), janitor_candidate_compare);
+    for (i = 0; i < walk->count; i++) {
+        if (walk->total > root->max_bytes || (evicted > 0 && walk->total > low_water)) {
+            if (apr_file_remove(walk->heap[i].path, pool) == APR_SUCCESS) {
+                walk->total -= walk->heap[i].size;
+                evicted++;
+            }
+        }
+        free(walk->heap[i].path);
+    }
+
+    if (evicted > 0) {
+        apr_atomic_add64(&janitor->evictions, evicted);
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, janitor_state.server,
+                    "mod_image_resize: evicted %u entries from cache %s, now %" APR_OFF_T_FMT " bytes",
+                    evicted, root->cache_dir, walk->total);
+    }
+
+    return evicted > 0 && walk->total > root->max_bytes;
+}
+
+// Janitor thread: becomes the janitor of the server when no other child is
+static void * APR_THREAD_FUNC janitor_thread(apr_thread_t *thread, void *data) {
+    janitor_walk *walk = malloc(sizeof(janitor_walk));
+    apr_pool_t *pool;
+
+    if (!walk || apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        free(walk);
+        return NULL;
+    }
+
+    while (!janitor_stopping()) {
+        int again = 0;
+
+        if (apr_global_mutex_trylock(janitor_mutex) == APR_SUCCESS) {
+            int i;
+            for (i = 0; i < janitor_roots->nelts && !janitor_stopping(); i++) {
+                again |= janitor_clean(&APR_ARRAY_IDX(janitor_roots, i, janitor_root), walk, pool);
+                apr_pool_clear(pool);
+            }
+            apr_global_mutex_unlock(janitor_mutex);
+
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, janitor_state.server,
+                        "mod_image_resize: cache hits %" APR_UINT64_T_FMT ", misses %"
+                        APR_UINT64_T_FMT ", evictions %" APR_UINT64_T_FMT,
+                        apr_atomic_read64(&janitor->hits), apr_atomic_read64(&janitor->misses),
+                        apr_atomic_read64(&janitor->evictions));
+        }
+
+        if (!again) {
+            janitor_sleep(janitor_interval);
+        }
+    }
+
+    apr_pool_destroy(pool);
+    free(walk);
+    return NULL;
+}
+
+// Stop the janitor thread of the child (pre-cleanup of the child pool)
+static apr_status_t janitor_stop(void *data) {
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(janitor_state.mutex);
+    janitor_state.stopping = 1;
+    apr_thread_cond_broadcast(janitor_state.wakeup);
+    apr_thread_mutex_unlock(janitor_state.mutex);
+
+    if (janitor_state.thread) {
+        apr_thread_join(&rv, janitor_state.thread);
+    }
+
+    return APR_SUCCESS;
+}
+
+// Start the janitor thread of a child - called from child_init
+apr_status_t image_resize_janitor_child_init(apr_pool_t *p, server_rec *s) {
+    apr_status_t rv;
+
+    if (!janitor_mutex) {
+        return APR_SUCCESS;
+    }
+
+    rv = apr_global_mutex_child_init(&janitor_mutex, apr_global_mutex_lockfile(janitor_mutex), p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_mutex_create(&janitor_state.mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_cond_create(&janitor_state.wakeup, p);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to initialize the cache janitor, "
+                    "ImageResizeCacheMaxBytes is not enforced");
+        return rv;
+    }
+
+    janitor_state.server = s;
+    janitor_state.stopping = 0;
+    janitor_state.thread = NULL;
+
+    // The thread must be joined before the pools it uses are destroyed
+    apr_pool_pre_cleanup_register(p, NULL, janitor_stop);
+
+    rv = apr_thread_create(&janitor_state.thread, NULL, janitor_thread, NULL, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to start the cache janitor thread");
+        janitor_state.thread = NULL;
+    }
+
+    return rv;
+}
@@ -0,0 +1,538 @@
+/**
+ * image_resize_memcache.c
+ *
+ * Shared memory cache of hot resized images for mod_image_resize.
+ * Encoded images are stored in a segment shared by all child processes,
+ * allocated in slabs of fixed-size chunks (one list per chunk size, evicted
+ * in least recently used order with a second chance), and indexed by a hash
+ * table keyed on the cache path.
+ *
+ * Lookups take no lock: each entry and each slab page carry a sequence
+ * counter, odd while they are being changed, and a lookup copies an entry
+ * out and retries if either counter moved meanwhile. A hit only sets the
+ * referenced bit of its entry. Stores and evictions are serialized by a
+ * global mutex.
+ */
+
+#include "mod_image_resize.h"
+#include <apr_atomic.h>
+
+// Slab pages are carved into chunks of a single size class
+#define MEMCACHE_PAGE_SIZE (1024 * 1024)
+#define MEMCACHE_MIN_CHUNK 1024
+#define MEMCACHE_CLASSES 11              // 1 KB to 1 MB chunks
+
+// Expected average entry size, used to size the hash table
+#define MEMCACHE_AVERAGE_ENTRY 8192
+
+// Lookups racing with a store retry this many times, then count as misses
+#define MEMCACHE_READ_ATTEMPTS 4
+
+// Longest hash chain followed by a lookup, against chains changed under it
+#define MEMCACHE_MAX_CHAIN 64
+
+// Entries given a second chance by one eviction before the tail is taken anyway
+#define MEMCACHE_MAX_SECOND_CHANCES 64
+
+// Orders the reads of a lookup against the sequence counters it checks
+#define MEMCACHE_READ_FENCE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+// Mutex type serializing the changes of the cache, configurable with the Mutex directive
+static const char *memcache_mutex_type = "image-resize-memcache";
+
+// Cached image, followed in its chunk by the key and the encoded bytes.
+// Links are offsets from the start of the segment, 0 meaning none.
+typedef struct {
+    apr_uint32_t seq;                    // Even while the entry is live, odd when free or changing
+    apr_uint32_t referenced;             // Set by hits, cleared by the eviction scan
+    apr_uint32_t hash;                   // Hash of the key
+    apr_uint32_t hash_next;              // Next entry of the same hash bucket
+    apr_uint32_t lru_prev;               // More recently used entry of the class
+    apr_uint32_t lru_next;               // Less recently used entry of the class
+    apr_uint32_t key_len;                // Length of the key (without NUL)
+    apr_uint32_t data_len;               // Number of encoded bytes
+    apr_uint32_t cls;                    // Size class of the chunk
+    apr_time_t mtime;                    // Modification time of the source of the image
+    char content_type[32];               // Content-Type of the encoded bytes
+} memcache_entry;
+
+// One size class of chunks
+typedef struct {
+    apr_uint32_t chunk_size;             // Size of the chunks of the class
+    apr_uint32_t free_head;              // Free chunks (linked through hash_next)
+    apr_uint32_t lru_head;               // Most recently stored or referenced entry
+    apr_uint32_t lru_tail;               // Next eviction candidate
+} memcache_class;
+
+// A slab page
+typedef struct {
+    apr_uint32_t cls;                    // Size class the page is carved for
+    apr_uint32_t seq;                    // Odd while the page moves to another class
+} memcache_page;
+
+// Segment header, followed by the hash buckets, the page table and the slab pages
+typedef struct {
+    apr_uint32_t nbuckets;               // Number of hash buckets
+    apr_uint32_t npages;                 // Number of slab pages
+    apr_uint32_t next_page;              // First page not yet given to a class
+    apr_uint32_t next_reassign;          // Where the search for a page to move starts
+    apr_uint32_t page_table_offset;      // Offset of the page table
+    apr_uint32_t pages_offset;           // Offset of the first slab page
+    apr_uint64_t hits;                   // Lookups answered from the cache
+    apr_uint64_t misses;                 // Lookups not in the cache
+    apr_uint64_t stores;                 // Images added to the cache
+    apr_uint64_t evictions;              // Images dropped to make room
+    apr_uint64_t reassigned;             // Pages moved from a class to another
+    memcache_class classes[MEMCACHE_CLASSES];
+    apr_uint32_t buckets[1];             // Heads of the hash chains
+} memcache_header;
+
+static apr_shm_t *memcache_shm = NULL;
+static memcache_header *memcache = NULL;
+static apr_global_mutex_t *memcache_mutex = NULL;
+
+#define MEMCACHE_ENTRY(offset) ((memcache_entry *)((char *)memcache + (offset)))
+#define MEMCACHE_OFFSET(entry) ((apr_uint32_t)((char *)(entry) - (char *)memcache))
+#define MEMCACHE_KEY(entry) ((char *)(entry) + sizeof(memcache_entry))
+#define MEMCACHE_DATA(entry) (MEMCACHE_KEY(entry) + (entry)->key_len)
+#define MEMCACHE_PAGES() ((memcache_page *)((char *)memcache + memcache->page_table_offset))
+#define MEMCACHE_PAGE_OF(offset) (((offset) - memcache->pages_offset) / MEMCACHE_PAGE_SIZE)
+
+// Smallest size class able to hold the given number of bytes, -1 if none
+static int memcache_class_for(apr_size_t size) {
+    int cls;
+    for (cls = 0; cls < MEMCACHE_CLASSES; cls++) {
+        if (size <= memcache->classes[cls].chunk_size) {
+            return cls;
+        }
+    }
+    return -1;
+}
+
+// Remove an entry from the LRU list of its class
+static void memcache_lru_remove(memcache_entry *entry) {
+    memcache_class *c = &memcache->classes[entry->cls];
+
+    if (entry->lru_prev) MEMCACHE_ENTRY(entry->lru_prev)->lru_next = entry->lru_next;
+    else c->lru_head = entry->lru_next;
+    if (entry->lru_next) MEMCACHE_ENTRY(entry->lru_next)->lru_prev = entry->lru_prev;
+    else c->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = 0;
+}
+
+// Remove a live entry from its hash chain and LRU list. Its sequence becomes
+// odd first, so that lookups copying it retry.
+static void memcache_unlink(memcache_entry *entry) {
+    apr_uint32_t offset = MEMCACHE_OFFSET(entry);
+    apr_uint32_t *link = &memcache->buckets[entry->hash % memcache->nbuckets];
+
+    apr_atomic_inc32(&entry->seq);
+    while (*link && *link != offset) {
+        link = &MEMCACHE_ENTRY(*link)->hash_next;
+    }
+    if (*link) {
+        *link = entry->hash_next;
+    }
+    entry->hash_next = 0;
+
+    memcache_lru_remove(entry);
+}
+
+// Put an entry at the head of the LRU list of its class
+static void memcache_lru_push(memcache_entry *entry) {
+    memcache_class *c = &memcache->classes[entry->cls];
+    apr_uint32_t offset = MEMCACHE_OFFSET(entry);
+
+    entry->lru_prev = 0;
+    entry->lru_next = c->lru_head;
+    if (c->lru_head) MEMCACHE_ENTRY(c->lru_head)->lru_prev = offset;
+    c->lru_head = offset;
+    if (!c->lru_tail) c->lru_tail = offset;
+}
+
+// Return the chunk of an unlinked entry to the free list of its class
+static void memcache_free(memcache_entry *entry) {
+    memcache_class *c = &memcache->classes[entry->cls];
+    entry->hash_next = c->free_head;
+    c->free_head = MEMCACHE_OFFSET(entry);
+}
+
+// Carve a slab page into free chunks of a class. The chunks get an odd
+// sequence, as free entries.
+static void memcache_carve(apr_uint32_t page, int cls) {
+    memcache_class *c = &memcache->classes[cls];
+    apr_uint32_t base = memcache->pages_offset + page * MEMCACHE_PAGE_SIZE;
+    apr_uint32_t chunk;
+
+    MEMCACHE_PAGES()[page].cls = cls;
+    for (chunk = 0; chunk + c->chunk_size <= MEMCACHE_PAGE_SIZE; chunk += c->chunk_size) {
+        memcache_entry *entry = MEMCACHE_ENTRY(base + chunk);
+        apr_atomic_set32(&entry->seq, 1);
+        entry->referenced = 0;
+        entry->cls = cls;
+        entry->lru_prev = entry->lru_next = 0;
+        memcache_free(entry);
+    }
+}
+
+// Move a slab page to a class left without any chunk once every page has been
+// given out: the entries of the page are evicted and its free chunks taken off
+// the free list of their class. Pages are taken in turn from the other classes.
+// Returns 0 if no page can be moved.
+static int memcache_reassign_page(int cls) {
+    memcache_page *pages = MEMCACHE_PAGES();
+    apr_uint32_t page = 0, i, base, chunk, *link;
+    memcache_class *victim;
+
+    for (i = 0; i < memcache->next_page; i++) {
+        page = (memcache->next_reassign + i) % memcache->next_page;
+        if (pages[page].cls != (apr_uint32_t)cls) {
+            break;
+        }
+    }
+    if (i == memcache->next_page) {
+        return 0;
+    }
+    memcache->next_reassign = (page + 1) % memcache->next_page;
+
+    // Lookups reading the page while it changes retry
+    apr_atomic_inc32(&pages[page].seq);
+
+    victim = &memcache->classes[pages[page].cls];
+    base = memcache->pages_offset + page * MEMCACHE_PAGE_SIZE;
+    for (chunk = 0; chunk + victim->chunk_size <= MEMCACHE_PAGE_SIZE; chunk += victim->chunk_size) {
+        memcache_entry *entry = MEMCACHE_ENTRY(base + chunk);
+        if (!(entry->seq & 1)) {
+            memcache_unlink(entry);
+            apr_atomic_inc64(&memcache->evictions);
+        }
+    }
+    for (link = &victim->free_head; *link; ) {
+        if (MEMCACHE_PAGE_OF(*link) == page) {
+            *link = MEMCACHE_ENTRY(*link)->hash_next;
+        } else {
+            link = &MEMCACHE_ENTRY(*link)->hash_next;
+        }
+    }
+
+    memcache_carve(page, cls);
+    memcache->reassigned++;
+    apr_atomic_inc32(&pages[page].seq);
+    return 1;
+}
+
+// Get a chunk of a size class: from the free list, from a new slab page, by
+// evicting the least recently used entry of the class, or from a page taken
+// from another class when the class has no entry at all. The chunk is
+// returned with an odd sequence.
+static memcache_entry *memcache_alloc(int cls) {
+    memcache_class *c = &memcache->classes[cls];
+    memcache_entry *entry;
+    int chances = 0;
+
+    if (!c->free_head && memcache->next_page < memcache->npages) {
+        memcache_carve(memcache->next_page++, cls);
+    }
+    if (!c->free_head && !c->lru_tail) {
+        memcache_reassign_page(cls);
+    }
+
+    if (c->free_head) {
+        entry = MEMCACHE_ENTRY(c->free_head);
+        c->free_head = entry->hash_next;
+        return entry;
+    }
+
+    // Second chance: entries hit since they were last scanned go back to the head
+    while (c->lru_tail) {
+        entry = MEMCACHE_ENTRY(c->lru_tail);
+        if (entry->referenced && chances++ < MEMCACHE_MAX_SECOND_CHANCES) {
+            entry->referenced = 0;
+            memcache_lru_remove(entry);
+            memcache_lru_push(entry);
+            continue;
+        }
+        memcache_unlink(entry);
+        apr_atomic_inc64(&memcache->evictions);
+        return entry;
+    }
+
+    return NULL;
+}
+
+// Find the entry of a key (mutex must be held)
+static memcache_entry *memcache_find(const char *key, apr_size_t key_len, apr_uint32_t hash) {
+    apr_uint32_t offset = memcache->buckets[hash % memcache->nbuckets];
+
+    while (offset) {
+        memcache_entry *entry = MEMCACHE_ENTRY(offset);
+        if (entry->hash == hash && entry->key_len == key_len &&
+            memcmp(MEMCACHE_KEY(entry), key, key_len) == 0) {
+            return entry;
+        }
+        offset = entry->hash_next;
+    }
+
+    return NULL;
+}
+
+// Check that an offset read without the mutex designates an entry header
+// inside a slab page
+static int memcache_valid_offset(apr_uint32_t offset) {
+    return offset >= memcache->pages_offset &&
+           MEMCACHE_PAGE_OF(offset) < memcache->next_page &&
+           (offset - memcache->pages_offset) % MEMCACHE_PAGE_SIZE + sizeof(memcache_entry) <= MEMCACHE_PAGE_SIZE;
+}
+
+// One lock-free lookup. Copies a matching entry into the buffer of the pool,
+// grown as needed. Returns 1 on a hit, 0 on a miss, and -1 when the entry or
+// the chain changed during the lookup.
+static int memcache_read(const char *key, apr_size_t key_len, apr_uint32_t hash,
+                         apr_pool_t *pool, char **buffer, apr_size_t *capacity,
+                         image_memcache_hit *hit) {
+    memcache_page *pages = MEMCACHE_PAGES();
+    apr_uint32_t offset = apr_atomic_read32(&memcache->buckets[hash % memcache->nbuckets]);
+    int steps;
+
+    for (steps = 0; offset && steps < MEMCACHE_MAX_CHAIN; steps++) {
+        memcache_entry *entry;
+        memcache_page *page;
+        apr_uint32_t page_seq, seq, next, data_len;
+        int match;
+
+        if (!memcache_valid_offset(offset)) {
+            return -1;
+        }
+        entry = MEMCACHE_ENTRY(offset);
+        page = &pages[MEMCACHE_PAGE_OF(offset)];
+        page_seq = apr_atomic_read32(&page->seq);
+        seq = apr_atomic_read32(&entry->seq);
+        if ((page_seq & 1) || (seq & 1)) {
+            return -1;
+        }
+        MEMCACHE_READ_FENCE();
+
+        next = entry->hash_next;
+        data_len = entry->data_len;
+        match = entry->hash == hash && entry->key_len == key_len &&
+                (offset - memcache->pages_offset) % MEMCACHE_PAGE_SIZE + sizeof(memcache_entry) +
+                key_len + data_len <= MEMCACHE_PAGE_SIZE &&
+                memcmp(MEMCACHE_KEY(entry), key, key_len) == 0;
+
+        if (match) {
+            char content_type[sizeof(entry->content_type)];
+            apr_time_t mtime = entry->mtime;
+
+            if (*capacity < data_len) {
+                *buffer = apr_palloc(pool, data_len);
+                *capacity = data_len;
+            }
+            memcpy(*buffer, MEMCACHE_KEY(entry) + key_len, data_len);
+            memcpy(content_type, entry->content_type, sizeof(content_type));
+            MEMCACHE_READ_FENCE();
+            if (apr_atomic_read32(&entry->seq) != seq || apr_atomic_read32(&page->seq) != page_seq) {
+                return -1;
+            }
+
+            content_type[sizeof(content_type) - 1] = '\0';
+            if (!entry->referenced) {
+                entry->referenced = 1;
+            }
+            hit->data = *buffer;
+            hit->size = data_len;
+            hit->content_type = apr_pstrdup(pool, content_type);
+            hit->mtime = mtime;
+            return 1;
+        }
+
+        MEMCACHE_READ_FENCE();
+        if (apr_atomic_read32(&entry->seq) != seq || apr_atomic_read32(&page->seq) != page_seq) {
+            return -1;
+        }
+        offset = next;
+    }
+
+    return 0;
+}
+
+// Register the mutex type of the cache - called from pre_config
+apr_status_t image_resize_memcache_pre_config(apr_pool_t *p) {
+    return ap_mutex_register(p, memcache_mutex_type, NULL, APR_LOCK_DEFAULT, 0);
+}
+
+// Create the shared memory cache - called from post_config, before forking
+apr_status_t image_resize_memcache_create(apr_pool_t *p, server_rec *s, apr_size_t size) {
+    apr_size_t header_size, table_offset;
+    apr_uint32_t nbuckets, max_pages;
+    apr_status_t rv;
+    int cls;
+
+    memcache = NULL;
+    if (size == 0) {
+        return APR_SUCCESS;
+    }
+
+    nbuckets = size / MEMCACHE_AVERAGE_ENTRY;
+    if (nbuckets < 64) nbuckets = 64;
+    max_pages = size / MEMCACHE_PAGE_SIZE + 1;
+    table_offset = APR_ALIGN_DEFAULT(sizeof(memcache_header) + (nbuckets - 1) * sizeof(apr_uint32_t));
+    header_size = APR_ALIGN_DEFAULT(table_offset + max_pages * sizeof(memcache_page));
+
+    if (size < header_size + MEMCACHE_PAGE_SIZE) {
+        size = header_size + MEMCACHE_PAGE_SIZE;
+    }
+
+    rv = ap_global_mutex_create(&memcache_mutex, NULL, memcache_mutex_type, NULL, s, p, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to create memory cache mutex");
+        return rv;
+    }
+
+    rv = apr_shm_create(&memcache_shm, size, NULL, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to create %" APR_SIZE_T_FMT " bytes memory cache", size);
+        return rv;
+    }
+
+    memcache = apr_shm_baseaddr_get(memcache_shm);
+    memset(memcache, 0, header_size);
+    memcache->nbuckets = nbuckets;
+    memcache->page_table_offset = table_offset;
+    memcache->pages_offset = header_size;
+    memcache->npages = (size - header_size) / MEMCACHE_PAGE_SIZE;
+    for (cls = 0; cls < MEMCACHE_CLASSES; cls++) {
+        memcache->classes[cls].chunk_size = MEMCACHE_MIN_CHUNK << cls;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                "mod_image_resize: memory cache of %u pages and %u buckets created",
+                memcache->npages, memcache->nbuckets);
+
+    return APR_SUCCESS;
+}
+
+// Reattach the cache mutex in a child process
+apr_status_t image_resize_memcache_child_init(apr_pool_t *p, server_rec *s) {
+    apr_status_t rv;
+
+    if (!memcache) {
+        return APR_SUCCESS;
+    }
+
+    rv = apr_global_mutex_child_init(&memcache_mutex, apr_global_mutex_lockfile(memcache_mutex), p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to attach memory cache mutex, memory cache disabled");
+        memcache = NULL;
+    }
+
+    return rv;
+}
+
+// Largest image the cache can hold for a key, 0 if the cache is disabled
+apr_size_t image_resize_memcache_max_size(const char *key) {
+    apr_size_t overhead;
+
+    if (!memcache) {
+        return 0;
+    }
+
+    overhead = sizeof(memcache_entry) + strlen(key);
+    return MEMCACHE_PAGE_SIZE > overhead ? MEMCACHE_PAGE_SIZE - overhead : 0;
+}
+
+// Look an image up without taking any lock. On a hit, the encoded bytes are
+// copied into the pool.
+int image_resize_memcache_fetch(const char *key, apr_pool_t *pool, image_memcache_hit *hit) {
+    apr_size_t key_len = strlen(key);
+    apr_uint32_t hash = image_resize_hash_string(key);
+    char *buffer = NULL;
+    apr_size_t capacity = 0;
+    int attempt, found = 0;
+
+    if (!memcache) {
+        return 0;
+    }
+
+    for (attempt = 0; attempt < MEMCACHE_READ_ATTEMPTS; attempt++) {
+        found = memcache_read(key, key_len, hash, pool, &buffer, &capacity, hit);
+        if (found >= 0) {
+            break;
+        }
+    }
+
+    if (found > 0) {
+        apr_atomic_inc64(&memcache->hits);
+        return 1;
+    }
+    apr_atomic_inc64(&memcache->misses);
+    return 0;
+}
+
+// Read the counters of the cache
+void image_resize_memcache_stats(apr_uint64_t *hits, apr_uint64_t *misses,
+                                 apr_uint64_t *stores, apr_uint64_t *evictions) {
+    *hits = *misses = *stores = *evictions = 0;
+
+    if (!memcache) {
+        return;
+    }
+    *hits = apr_atomic_read64(&memcache->hits);
+    *misses = apr_atomic_read64(&memcache->misses);
+    *stores = apr_atomic_read64(&memcache->stores);
+    *evictions = apr_atomic_read64(&memcache->evictions);
+}
+
+// Add or replace an image. Images too large for the biggest chunk are skipped.
+void image_resize_memcache_store(const char *key, const void *data, apr_size_t size,
+                                 const char *content_type, apr_time_t mtime) {
+    apr_size_t key_len = strlen(key);
+    apr_uint32_t hash = image_resize_hash_string(key);
+    memcache_entry *entry;
+    int cls;
+
+    if (!memcache) {
+        return;
+    }
+
+    cls = memcache_class_for(sizeof(memcache_entry) + key_len + size);
+    if (cls < 0) {
+        return;
+    }
+
+    if (apr_global_mutex_lock(memcache_mutex) != APR_SUCCESS) {
+        return;
+    }
+
+    // Drop the previous version of the image
+    entry = memcache_find(key, key_len, hash);
+    if (entry) {
+        memcache_unlink(entry);
+        memcache_free(entry);
+    }
+
+    // The entry is filled while its sequence is odd, and published in its hash
+    // chain once complete
+    entry = memcache_alloc(cls);
+    if (entry) {
+        entry->referenced = 0;
+        entry->hash = hash;
+        entry->key_len = key_len;
+        entry->data_len = size;
+        entry->cls = cls;
+        entry->mtime = mtime;
+        apr_cpystrn(entry->content_type, content_type, sizeof(entry->content_type));
+        memcpy(MEMCACHE_KEY(entry), key, key_len);
+        memcpy(MEMCACHE_DATA(entry), data, size);
+        entry->hash_next = memcache->buckets[hash % memcache->nbuckets];
+        apr_atomic_inc32(&entry->seq);
+        apr_atomic_set32(&memcache->buckets[hash % memcache->nbuckets], MEMCACHE_OFFSET(entry));
+        memcache_lru_push(entry);
+        apr_atomic_inc64(&memcache->stores);
+    }
+
+    apr_global_mutex_unlock(memcache_mutex);
+}
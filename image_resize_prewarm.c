@@ -0,0 +1,654 @@
+/**
+ * image_resize_prewarm.c
+ *
+ * Background rendering of the ImageResizePrewarm sizes. One child of the
+ * server, elected with a global mutex, watches the source directories with
+ * inotify and hands new and modified images to a small pool of threads,
+ * which render every configured size through the same cache and render
+ * locks as the requests. The render threads only run in the leader.
+ */
+
+#include "mod_image_resize.h"
+#include <apr_atomic.h>
+#include <apr_shm.h>
+#include <apr_thread_proc.h>
+#include <apr_hash.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+// Capacity of the queue of source images waiting for their variants
+#define PREWARM_QUEUE_SIZE 1024
+
+// Delay between two attempts of a child to become the prewarm leader
+#define PREWARM_ELECTION_INTERVAL apr_time_from_sec(5)
+
+// Longest wait for inotify events before checking for shutdown, in milliseconds
+#define PREWARM_POLL_TIMEOUT 1000
+
+// Sources modified this long before the previous leader of the generation was
+// last idle are queued again by the next one, for the events it had not read
+#define PREWARM_SYNC_MARGIN apr_time_from_sec(60)
+
+// Events of the source directories worth a render
+#define PREWARM_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+// Mutex type electing the prewarm leader, configurable with the Mutex directive
+static const char *prewarm_mutex_type = "image-resize-prewarm";
+
+// A source directory and the configurations rendering its images
+typedef struct {
+    const char *image_dir;       // Source image directory
+    apr_array_header_t *configs; // Directory configs using it (image_resize_config *)
+} prewarm_root;
+
+// A source image waiting for its variants
+typedef struct {
+    const prewarm_root *root;    // Source directory of the image
+    char *filename;              // Path relative to the source directory (malloc)
+} prewarm_job;
+
+// A watched directory
+typedef struct {
+    const prewarm_root *root;    // Source directory it belongs to
+    const char *relpath;         // Path relative to the source directory ("" for the root)
+} prewarm_watch;
+
+// State shared by the successive leaders of a generation. It is created again
+// by each generation, so the first leader after a restart scans everything.
+typedef struct {
+    volatile apr_uint64_t synced; // Last time a leader had rendered every event (apr_time_t)
+} prewarm_shared;
+
+// Source directories with prewarm sizes, built before the children are forked
+static apr_array_header_t *prewarm_roots = NULL;
+static apr_global_mutex_t *prewarm_mutex = NULL;
+static apr_shm_t *prewarm_shm = NULL;
+static prewarm_shared *prewarm_sync = NULL;
+
+#ifdef __linux__
+
+// Per-child state of the background renders
+static struct {
+    server_rec *server;          // Server the renders log to
+    apr_thread_mutex_t *mutex;   // Protects the queue and the stop flag
+    apr_thread_cond_t *work;     // Signalled when a job is queued, or on shutdown
+    apr_thread_cond_t *space;    // Signalled when a job is taken, or on shutdown
+    prewarm_job queue[PREWARM_QUEUE_SIZE];
+    int head;                    // Next job to render
+    int count;                   // Number of queued jobs
+    int busy;                    // Jobs being rendered
+    int stopping;                // Set when the child shuts down
+    int leading;                 // Set while the child is the leader and its render threads run
+    apr_time_t since;            // Sources modified before this are skipped by scans (watcher only)
+    apr_thread_t *watcher;       // Watcher thread, running in every child
+    apr_thread_t **workers;      // Render threads, running in the leader only
+    int max_workers;
+    int nworkers;
+} prewarm;
+
+// Log sink of background renders
+static void prewarm_render_log(const image_render_ctx *ctx, int level, const char *msg) {
+    ap_log_error(APLOG_MARK, level, 0, (server_rec *)ctx->log_data, "[image_resize] %s", msg);
+}
+
+// Check if the child is shutting down
+static int prewarm_stopping(void) {
+    int stopping;
+
+    apr_thread_mutex_lock(prewarm.mutex);
+    stopping = prewarm.stopping;
+    apr_thread_mutex_unlock(prewarm.mutex);
+    return stopping;
+}
+
+// Sleep up to the given time, waking up early on shutdown
+static void prewarm_sleep(apr_interval_time_t timeout) {
+    apr_thread_mutex_lock(prewarm.mutex);
+    if (!prewarm.stopping) {
+        apr_thread_cond_timedwait(prewarm.work, prewarm.mutex, timeout);
+    }
+    apr_thread_mutex_unlock(prewarm.mutex);
+}
+
+// Queue a source image, waiting for room in the queue
+static void prewarm_enqueue(const prewarm_root *root, const char *filename) {
+    char *copy = strdup(filename);
+
+    if (!copy) {
+        return;
+    }
+
+    apr_thread_mutex_lock(prewarm.mutex);
+    while (prewarm.count == PREWARM_QUEUE_SIZE && !prewarm.stopping) {
+        apr_thread_cond_wait(prewarm.space, prewarm.mutex);
+    }
+    if (prewarm.stopping) {
+        apr_thread_mutex_unlock(prewarm.mutex);
+        free(copy);
+        return;
+    }
+
+    prewarm_job *job = &prewarm.queue[(prewarm.head + prewarm.count) % PREWARM_QUEUE_SIZE];
+    job->root = root;
+    job->filename = copy;
+    prewarm.count++;
+    apr_thread_cond_signal(prewarm.work);
+    apr_thread_mutex_unlock(prewarm.mutex);
+}
+
+// Take the next source image of the queue. Returns 0 on shutdown, or when the
+// child is no longer the leader.
+static int prewarm_dequeue(prewarm_job *job) {
+    apr_thread_mutex_lock(prewarm.mutex);
+    while (prewarm.count == 0 && prewarm.leading && !prewarm.stopping) {
+        apr_thread_cond_wait(prewarm.work, prewarm.mutex);
+    }
+    if (prewarm.stopping || !prewarm.leading) {
+        apr_thread_mutex_unlock(prewarm.mutex);
+        return 0;
+    }
+
+    *job = prewarm.queue[prewarm.head];
+    prewarm.head = (prewarm.head + 1) % PREWARM_QUEUE_SIZE;
+    prewarm.count--;
+    prewarm.busy++;
+    apr_thread_cond_signal(prewarm.space);
+    apr_thread_mutex_unlock(prewarm.mutex);
+    return 1;
+}
+
+// Mark a job taken by prewarm_dequeue() as rendered
+static void prewarm_job_done(prewarm_job *job) {
+    free(job->filename);
+
+    apr_thread_mutex_lock(prewarm.mutex);
+    prewarm.busy--;
+    apr_thread_mutex_unlock(prewarm.mutex);
+}
+
+// Drop the queued jobs nobody will render
+static void prewarm_drop_jobs(void) {
+    apr_thread_mutex_lock(prewarm.mutex);
+    while (prewarm.count > 0) {
+        free(prewarm.queue[prewarm.head].filename);
+        prewarm.head = (prewarm.head + 1) % PREWARM_QUEUE_SIZE;
+        prewarm.count--;
+    }
+    apr_thread_mutex_unlock(prewarm.mutex);
+}
+
+// Record that every event read so far has been rendered, if the queue is empty.
+// The next leader of the generation then only queues the sources modified since.
+static void prewarm_mark_synced(apr_time_t read_at) {
+    int idle;
+
+    if (!prewarm_sync) {
+        return;
+    }
+    apr_thread_mutex_lock(prewarm.mutex);
+    idle = prewarm.count == 0 && prewarm.busy == 0;
+    apr_thread_mutex_unlock(prewarm.mutex);
+    if (idle) {
+        apr_atomic_set64(&prewarm_sync->synced, (apr_uint64_t)read_at);
+    }
+}
+
+// Set the modification time from which scans queue the sources
+static void prewarm_scan_from_sync(void) {
+    apr_time_t synced = prewarm_sync ? (apr_time_t)apr_atomic_read64(&prewarm_sync->synced) : 0;
+
+    prewarm.since = synced > PREWARM_SYNC_MARGIN ? synced - PREWARM_SYNC_MARGIN : 0;
+}
+
+// Render every prewarm size of a source image
+static void prewarm_render(const prewarm_job *job, apr_pool_t *pool) {
+    image_render_ctx ctx;
+    int i;
+
+    ctx.pool = pool;
+    ctx.log = prewarm_render_log;
+    ctx.log_data = prewarm.server;
+    ctx.background = 1;
+    ctx.timings = NULL;
+    ctx.log_level = RENDER_LOG_DEBUG;
+    while (ctx.log_level > RENDER_LOG_ERR && !APLOG_IS_LEVEL(prewarm.server, ctx.log_level)) {
+        ctx.log_level--;
+    }
+
+    // Each configuration decodes the source once for all its sizes
+    for (i = 0; i < job->root->configs->nelts; i++) {
+        const image_resize_config *cfg = APR_ARRAY_IDX(job->root->configs, i, image_resize_config *);
+        // A modified source always replaces its variants, whatever ImageResizeCheckMTime says
+        image_resize_config job_cfg = *cfg;
+        job_cfg.check_source_mtime = 1;
+
+        if (image_resize_render_cached_variants(&ctx, &job_cfg, job->filename,
+                                                image_format_from_filename(job->filename),
+                                                (const image_resize_size *)cfg->prewarm_sizes->elts,
+                                                cfg->prewarm_sizes->nelts) == 0) {
+            RENDER_DEBUG_LOG(&ctx, "Prewarmed %d variants of %s",
+                             cfg->prewarm_sizes->nelts, job->filename);
+        }
+    }
+}
+
+// Render thread: renders the queued source images until shutdown
+static void * APR_THREAD_FUNC prewarm_worker(apr_thread_t *thread, void *data) {
+    apr_pool_t *pool;
+    prewarm_job job;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    while (prewarm_dequeue(&job)) {
+        prewarm_render(&job, pool);
+        prewarm_job_done(&job);
+        apr_pool_clear(pool);
+    }
+
+    apr_pool_destroy(pool);
+    image_resize_render_thread_done();
+    return NULL;
+}
+
+// Check if a file name is worth a render: a supported image, not a hidden or temporary file
+static int prewarm_wanted(const char *name) {
+    return name[0] != '.' && image_format_from_filename(name) != IMAGE_FORMAT_UNKNOWN;
+}
+
+// Check if a directory is the cache directory of a configuration of its root,
+// so that the variants written there do not trigger more renders
+static int prewarm_is_cache_dir(const prewarm_root *root, const char *path) {
+    int i;
+
+    for (i = 0; i < root->configs->nelts; i++) {
+        const image_resize_config *cfg = APR_ARRAY_IDX(root->configs, i, image_resize_config *);
+        if (strcmp(cfg->cache_dir, path) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Watch a directory and its subdirectories, and queue the images they hold that
+// were modified since prewarm.since. Watches are allocated from pool, which
+// lives as long as the inotify descriptor.
+static void prewarm_scan(int fd, apr_hash_t *watches, const prewarm_root *root,
+                         const char *relpath, apr_pool_t *pool) {
+    apr_pool_t *scratch;
+    apr_dir_t *dir;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+
+    if (apr_pool_create(&scratch, pool) != APR_SUCCESS) {
+        return;
+    }
+
+    const char *path = relpath[0] ? apr_pstrcat(scratch, root->image_dir, "/", relpath, NULL)
+                                  : root->image_dir;
+    if (prewarm_is_cache_dir(root, path)) {
+        apr_pool_destroy(scratch);
+        return;
+    }
+
+    // Watch before listing, so that images added during the scan are not missed
+    int wd = inotify_add_watch(fd, path, PREWARM_WATCH_MASK);
+    if (wd < 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, errno, prewarm.server,
+                    "mod_image_resize: unable to watch %s for ImageResizePrewarm", path);
+    } else if (!apr_hash_get(watches, &wd, sizeof(int))) {
+        prewarm_watch *watch = apr_palloc(pool, sizeof(prewarm_watch));
+        int *key = apr_palloc(pool, sizeof(int));
+        watch->root = root;
+        watch->relpath = apr_pstrdup(pool, relpath);
+        *key = wd;
+        apr_hash_set(watches, key, sizeof(int), watch);
+    }
+
+    if (apr_dir_open(&dir, path, scratch) != APR_SUCCESS) {
+        apr_pool_destroy(scratch);
+        return;
+    }
+
+    while (!prewarm_stopping()) {
+        rv = apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE | APR_FINFO_MTIME | APR_FINFO_CTIME, dir);
+        if (rv != APR_SUCCESS && rv != APR_INCOMPLETE) {
+            break;
+        }
+        if (finfo.name[0] == '.') {
+            continue; // ".", ".." and hidden entries
+        }
+        const char *child = relpath[0] ? apr_pstrcat(scratch, relpath, "/", finfo.name, NULL)
+                                       : finfo.name;
+        if (finfo.filetype == APR_DIR) {
+            prewarm_scan(fd, watches, root, child, pool);
+        } else if (finfo.filetype == APR_REG && prewarm_wanted(finfo.name) &&
+                   (finfo.mtime >= prewarm.since || finfo.ctime >= prewarm.since)) {
+            prewarm_enqueue(root, child);
+        }
+    }
+
+    apr_dir_close(dir);
+    apr_pool_destroy(scratch);
+}
+
+// Scan all the source directories
+static void prewarm_scan_all(int fd, apr_hash_t *watches, apr_pool_t *pool) {
+    int i;
+
+    prewarm_scan_from_sync();
+    if (prewarm.since > 0) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, prewarm.server,
+                    "mod_image_resize: scanning sources, queuing those modified in the last %d seconds",
+                    (int)apr_time_sec(apr_time_now() - prewarm.since));
+    }
+
+    for (i = 0; i < prewarm_roots->nelts && !prewarm_stopping(); i++) {
+        prewarm_scan(fd, watches, &APR_ARRAY_IDX(prewarm_roots, i, prewarm_root), "", pool);
+    }
+}
+
+// Handle the events read from inotify
+static void prewarm_handle_events(int fd, apr_hash_t *watches, const char *buf, ssize_t len,
+                                  apr_pool_t *pool, apr_pool_t *scratch) {
+    const char *p = buf;
+
+    while (p < buf + len) {
+        const struct inotify_event *event = (const struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            // Events were lost: go through everything modified since the queue was last empty
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, prewarm.server,
+                        "mod_image_resize: inotify queue overflow, rescanning source directories");
+            prewarm_scan_all(fd, watches, pool);
+            continue;
+        }
+
+        prewarm_watch *watch = apr_hash_get(watches, &event->wd, sizeof(int));
+        if (!watch) {
+            continue;
+        }
+        if (event->mask & IN_IGNORED) {
+            // Directory removed
+            apr_hash_set(watches, &event->wd, sizeof(int), NULL);
+            continue;
+        }
+        if (event->len == 0) {
+            continue;
+        }
+
+        const char *name = watch->relpath[0]
+                           ? apr_pstrcat(scratch, watch->relpath, "/", event->name, NULL)
+                           : apr_pstrdup(scratch, event->name);
+        if (event->mask & IN_ISDIR) {
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                prewarm_scan(fd, watches, watch->root, name, pool);
+            }
+        } else if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && prewarm_wanted(event->name)) {
+            prewarm_enqueue(watch->root, name);
+        }
+    }
+}
+
+// Watch the source directories until shutdown (leader only)
+static void prewarm_watch_sources(apr_pool_t *pool) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    apr_hash_t *watches = apr_hash_make(pool);
+    apr_pool_t *events_pool;
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, prewarm.server,
+                    "mod_image_resize: unable to initialize inotify, ImageResizePrewarm disabled");
+        return;
+    }
+    if (apr_pool_create(&events_pool, pool) != APR_SUCCESS) {
+        close(fd);
+        return;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, prewarm.server,
+                "mod_image_resize: child %" APR_PID_T_FMT " is the prewarm leader", getpid());
+
+    // Catch up with the images added while no child was watching. A previous
+    // leader of the same generation leaves the time it had rendered every
+    // event, and only the sources modified since are queued again.
+    prewarm_scan_all(fd, watches, pool);
+
+    while (!prewarm_stopping()) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        apr_time_t read_at = apr_time_now();
+        ssize_t len;
+
+        if (poll(&pfd, 1, PREWARM_POLL_TIMEOUT) > 0) {
+            while ((len = read(fd, buf, sizeof(buf))) > 0) {
+                prewarm_handle_events(fd, watches, buf, len, pool, events_pool);
+                apr_pool_clear(events_pool);
+            }
+        }
+        prewarm_mark_synced(read_at);
+    }
+
+    close(fd);
+}
+
+// Start the render threads of a new leader. Returns the number started.
+static int prewarm_start_workers(apr_pool_t *pool) {
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(prewarm.mutex);
+    prewarm.leading = 1;
+    apr_thread_mutex_unlock(prewarm.mutex);
+
+    for (prewarm.nworkers = 0; prewarm.nworkers < prewarm.max_workers; prewarm.nworkers++) {
+        rv = apr_thread_create(&prewarm.workers[prewarm.nworkers], NULL, prewarm_worker, NULL, pool);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, prewarm.server,
+                        "mod_image_resize: unable to start prewarm thread");
+            break;
+        }
+    }
+    return prewarm.nworkers;
+}
+
+// Stop the render threads when the child is no longer the leader, dropping
+// the jobs they had not taken
+static void prewarm_stop_workers(void) {
+    apr_status_t rv;
+    int i;
+
+    apr_thread_mutex_lock(prewarm.mutex);
+    prewarm.leading = 0;
+    apr_thread_cond_broadcast(prewarm.work);
+    apr_thread_cond_broadcast(prewarm.space);
+    apr_thread_mutex_unlock(prewarm.mutex);
+
+    for (i = 0; i < prewarm.nworkers; i++) {
+        apr_thread_join(&rv, prewarm.workers[i]);
+    }
+    prewarm.nworkers = 0;
+    prewarm_drop_jobs();
+}
+
+// Watcher thread: becomes the leader of the server when no other child is, and
+// runs the render threads while it is
+static void * APR_THREAD_FUNC prewarm_watcher(apr_thread_t *thread, void *data) {
+    apr_pool_t *pool;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    while (!prewarm_stopping()) {
+        if (apr_global_mutex_trylock(prewarm_mutex) == APR_SUCCESS) {
+            if (prewarm_start_workers(pool) > 0) {
+                prewarm_watch_sources(pool);
+            }
+            prewarm_stop_workers();
+            apr_global_mutex_unlock(prewarm_mutex);
+            apr_pool_clear(pool);
+            if (!prewarm_stopping()) {
+                prewarm_sleep(PREWARM_ELECTION_INTERVAL); // inotify or thread failure: retry later
+            }
+        } else {
+            prewarm_sleep(PREWARM_ELECTION_INTERVAL);
+        }
+    }
+
+    apr_pool_destroy(pool);
+    return NULL;
+}
+
+// Stop the background threads of the child (pre-cleanup of the child pool). The
+// watcher stops the render threads of a leader before it exits.
+static apr_status_t prewarm_stop(void *data) {
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(prewarm.mutex);
+    prewarm.stopping = 1;
+    apr_thread_cond_broadcast(prewarm.work);
+    apr_thread_cond_broadcast(prewarm.space);
+    apr_thread_mutex_unlock(prewarm.mutex);
+
+    if (prewarm.watcher) {
+        apr_thread_join(&rv, prewarm.watcher);
+    }
+
+    return APR_SUCCESS;
+}
+
+#endif /* __linux__ */
+
+// Register the mutex type of the leader election - called from pre_config
+apr_status_t image_resize_prewarm_pre_config(apr_pool_t *p) {
+    return ap_mutex_register(p, prewarm_mutex_type, NULL, APR_LOCK_DEFAULT, 0);
+}
+
+// Group the prewarm configurations of all servers by source directory and create
+// the leader election mutex - called from post_config, before forking
+apr_status_t image_resize_prewarm_create(apr_pool_t *p, server_rec *s) {
+    server_rec *vs;
+    apr_status_t rv;
+    int i, j;
+
+    prewarm_roots = NULL;
+    prewarm_mutex = NULL;
+    prewarm_sync = NULL;
+
+    for (vs = s; vs; vs = vs->next) {
+        image_resize_server_config *scfg = ap_get_module_config(vs->module_config,
+                                                                &image_resize_module);
+        for (i = 0; i < scfg->prewarm_configs->nelts; i++) {
+            image_resize_config *cfg = APR_ARRAY_IDX(scfg->prewarm_configs, i, image_resize_config *);
+            prewarm_root *root = NULL;
+
+            if (!prewarm_roots) {
+                prewarm_roots = apr_array_make(p, 1, sizeof(prewarm_root));
+            }
+            for (j = 0; j < prewarm_roots->nelts; j++) {
+                if (strcmp(APR_ARRAY_IDX(prewarm_roots, j, prewarm_root).image_dir, cfg->image_dir) == 0) {
+                    root = &APR_ARRAY_IDX(prewarm_roots, j, prewarm_root);
+                    break;
+                }
+            }
+            if (!root) {
+                root = apr_array_push(prewarm_roots);
+                root->image_dir = cfg->image_dir;
+                root->configs = apr_array_make(p, 1, sizeof(image_resize_config *));
+            }
+            APR_ARRAY_PUSH(root->configs, image_resize_config *) = cfg;
+        }
+    }
+
+    if (!prewarm_roots) {
+        return APR_SUCCESS;
+    }
+
+#ifdef __linux__
+    rv = ap_global_mutex_create(&prewarm_mutex, NULL, prewarm_mutex_type, NULL, s, p, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to create prewarm mutex");
+        return rv;
+    }
+
+    // Without it, every new leader queues all the sources again
+    if (apr_shm_create(&prewarm_shm, sizeof(prewarm_shared), NULL, p) == APR_SUCCESS) {
+        prewarm_sync = apr_shm_baseaddr_get(prewarm_shm);
+        memset(prewarm_sync, 0, sizeof(prewarm_shared));
+    } else {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                    "mod_image_resize: unable to create prewarm shared memory, "
+                    "each new prewarm leader will scan every source");
+    }
+#else
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                "mod_image_resize: ImageResizePrewarm requires inotify and is ignored on this platform");
+    prewarm_roots = NULL;
+    rv = APR_SUCCESS;
+#endif
+
+    return rv;
+}
+
+// Start the watcher thread of a child, which starts the render threads if the
+// child becomes the leader - called from child_init
+apr_status_t image_resize_prewarm_child_init(apr_pool_t *p, server_rec *s) {
+#ifdef __linux__
+    image_resize_server_config *scfg = ap_get_module_config(s->module_config, &image_resize_module);
+    apr_status_t rv;
+
+    if (!prewarm_mutex) {
+        return APR_SUCCESS;
+    }
+
+    rv = apr_global_mutex_child_init(&prewarm_mutex, apr_global_mutex_lockfile(prewarm_mutex), p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_mutex_create(&prewarm.mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_cond_create(&prewarm.work, p);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_cond_create(&prewarm.space, p);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to initialize the prewarm threads, ImageResizePrewarm disabled");
+        return rv;
+    }
+
+    prewarm.server = s;
+    prewarm.head = 0;
+    prewarm.count = 0;
+    prewarm.busy = 0;
+    prewarm.stopping = 0;
+    prewarm.leading = 0;
+    prewarm.since = 0;
+    prewarm.watcher = NULL;
+    prewarm.nworkers = 0;
+    prewarm.max_workers = scfg->prewarm_threads;
+    prewarm.workers = apr_pcalloc(p, sizeof(apr_thread_t *) * scfg->prewarm_threads);
+
+    // The threads must be joined before the pools they use are destroyed
+    apr_pool_pre_cleanup_register(p, NULL, prewarm_stop);
+
+    rv = apr_thread_create(&prewarm.watcher, NULL, prewarm_watcher, NULL, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to start prewarm thread");
+        prewarm.watcher = NULL;
+    }
+
+    return rv;
+#else
+    return APR_SUCCESS;
+#endif
+}
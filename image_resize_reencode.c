@@ -0,0 +1,212 @@
+/**
+ * image_resize_reencode.c
+ *
+ * Second tier of ImageResizeTwoTierEncode. A cache miss is answered with a
+ * fast, low-effort encode and its cache entry is queued here: a background
+ * thread of each child encodes the image again at the configured effort and
+ * replaces the entry with an atomic rename, holding the render locks of the
+ * key like any other render.
+ */
+
+#include "mod_image_resize.h"
+#include <apr_thread_proc.h>
+
+// Capacity of the queue of cache entries waiting for their full-effort encode.
+// Entries beyond it keep their fast encode until they are rendered again.
+#define REENCODE_QUEUE_SIZE 256
+
+// A cache entry waiting for its full-effort encode
+typedef struct {
+    const image_resize_config *cfg; // Directory config of the entry, lives as long as the child
+    image_request req;           // Render parameters, filename allocated with malloc
+    char *cache_path;            // Cache entry to replace (malloc)
+} reencode_job;
+
+// Per-child state of the re-encodes
+static struct {
+    server_rec *server;          // Server the re-encodes log to
+    apr_thread_mutex_t *mutex;   // Protects the queue and the stop flag
+    apr_thread_cond_t *work;     // Signalled when a job is queued, or on shutdown
+    reencode_job queue[REENCODE_QUEUE_SIZE];
+    int head;                    // Next job to encode
+    int count;                   // Number of queued jobs
+    int stopping;                // Set when the child shuts down
+    apr_thread_t *thread;        // Re-encode thread, NULL when not running
+} reencode;
+
+// Log sink of the re-encodes
+static void reencode_render_log(const image_render_ctx *ctx, int level, const char *msg) {
+    ap_log_error(APLOG_MARK, level, 0, (server_rec *)ctx->log_data, "[image_resize] %s", msg);
+}
+
+static void reencode_job_free(reencode_job *job) {
+    free((char *)job->req.filename);
+    free(job->cache_path);
+}
+
+// Take the next job of the queue. Returns 0 on shutdown.
+static int reencode_dequeue(reencode_job *job) {
+    apr_thread_mutex_lock(reencode.mutex);
+    while (reencode.count == 0 && !reencode.stopping) {
+        apr_thread_cond_wait(reencode.work, reencode.mutex);
+    }
+    if (reencode.stopping) {
+        apr_thread_mutex_unlock(reencode.mutex);
+        return 0;
+    }
+
+    *job = reencode.queue[reencode.head];
+    reencode.head = (reencode.head + 1) % REENCODE_QUEUE_SIZE;
+    reencode.count--;
+    apr_thread_mutex_unlock(reencode.mutex);
+    return 1;
+}
+
+// Encode a cache entry again at full effort, replacing the file and the memory cache
+static void reencode_render(const reencode_job *job, apr_pool_t *pool) {
+    image_render_ctx ctx;
+
+    ctx.pool = pool;
+    ctx.log = reencode_render_log;
+    ctx.log_data = reencode.server;
+    ctx.background = 1;
+    ctx.timings = NULL;
+    ctx.log_level = RENDER_LOG_DEBUG;
+    while (ctx.log_level > RENDER_LOG_ERR && !APLOG_IS_LEVEL(reencode.server, ctx.log_level)) {
+        ctx.log_level--;
+    }
+
+    if (image_resize_reencode_cached(&ctx, job->cfg, &job->req, job->cache_path) == 0) {
+        RENDER_DEBUG_LOG(&ctx, "Re-encoded %s at full effort", job->cache_path);
+    }
+}
+
+// Re-encode thread: encodes the queued entries until shutdown
+static void * APR_THREAD_FUNC reencode_worker(apr_thread_t *thread, void *data) {
+    apr_pool_t *pool;
+    reencode_job job;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    while (reencode_dequeue(&job)) {
+        reencode_render(&job, pool);
+        reencode_job_free(&job);
+        apr_pool_clear(pool);
+    }
+
+    apr_pool_destroy(pool);
+    image_resize_render_thread_done();
+    return NULL;
+}
+
+// Stop the re-encode thread of the child (pre-cleanup of the child pool)
+static apr_status_t reencode_stop(void *data) {
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(reencode.mutex);
+    reencode.stopping = 1;
+    apr_thread_cond_signal(reencode.work);
+    apr_thread_mutex_unlock(reencode.mutex);
+
+    if (reencode.thread) {
+        apr_thread_join(&rv, reencode.thread);
+        reencode.thread = NULL;
+    }
+
+    // Drop the jobs nobody will encode
+    while (reencode.count > 0) {
+        reencode_job_free(&reencode.queue[reencode.head]);
+        reencode.head = (reencode.head + 1) % REENCODE_QUEUE_SIZE;
+        reencode.count--;
+    }
+
+    return APR_SUCCESS;
+}
+
+// Queue a freshly rendered fast encode for its full-effort encode. Never waits:
+// when the queue is full, the entry keeps its fast encode.
+void image_resize_reencode_enqueue(const image_resize_config *cfg, const image_request *req,
+                                   const char *cache_path) {
+    reencode_job *job;
+    char *filename, *path;
+
+    if (!reencode.thread) {
+        return;
+    }
+
+    filename = strdup(req->filename);
+    path = strdup(cache_path);
+    if (!filename || !path) {
+        free(filename);
+        free(path);
+        return;
+    }
+
+    apr_thread_mutex_lock(reencode.mutex);
+    if (reencode.count == REENCODE_QUEUE_SIZE || reencode.stopping) {
+        apr_thread_mutex_unlock(reencode.mutex);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, reencode.server,
+                    "mod_image_resize: re-encode queue full, %s keeps its fast encode", cache_path);
+        free(filename);
+        free(path);
+        return;
+    }
+
+    job = &reencode.queue[(reencode.head + reencode.count) % REENCODE_QUEUE_SIZE];
+    job->cfg = cfg;
+    job->req = *req;
+    job->req.filename = filename;
+    job->cache_path = path;
+    reencode.count++;
+    apr_thread_cond_signal(reencode.work);
+    apr_thread_mutex_unlock(reencode.mutex);
+}
+
+// Start the re-encode thread of a child when a directory uses the two-tier
+// mode - called from child_init, once libvips is ready
+apr_status_t image_resize_reencode_child_init(apr_pool_t *p, server_rec *s) {
+    server_rec *vs;
+    apr_status_t rv;
+    int used = 0;
+
+    reencode.thread = NULL;
+    for (vs = s; vs && !used; vs = vs->next) {
+        image_resize_server_config *scfg = ap_get_module_config(vs->module_config,
+                                                                &image_resize_module);
+        used = scfg->two_tier;
+    }
+    if (!used) {
+        return APR_SUCCESS;
+    }
+
+    rv = apr_thread_mutex_create(&reencode.mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_cond_create(&reencode.work, p);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to initialize the re-encode thread, "
+                    "fast encodes will not be replaced");
+        return rv;
+    }
+
+    reencode.server = s;
+    reencode.head = 0;
+    reencode.count = 0;
+    reencode.stopping = 0;
+
+    // The thread must be joined before the pools it uses are destroyed
+    apr_pool_pre_cleanup_register(p, NULL, reencode_stop);
+
+    rv = apr_thread_create(&reencode.thread, NULL, reencode_worker, NULL, p);
+    if (rv != APR_SUCCESS) {
+        reencode.thread = NULL;
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to start the re-encode thread, "
+                    "fast encodes will not be replaced");
+    }
+
+    return rv;
+}
@@ -0,0 +1,576 @@
+/**
+ * image_resize_render.c
+ *
+ * Image rendering pipeline of mod_image_resize.
+ * Uses libvips for image processing, which is thread-safe and high-performance.
+ */
+
+#include "image_resize_render.h"
+#include <apr_portable.h>
+#include <apr_atomic.h>
+#include <apr_thread_proc.h>
+#include <vips/vips.h>
+#include <unistd.h>
+
+// Track libvips initialization in child processes
+static int libvips_initialized = 0;
+
+int image_resize_render_init(const char *name, const image_vips_tuning *tuning) {
+    if (VIPS_INIT(name)) {
+        return -1;
+    }
+    libvips_initialized = 1;
+    
+    if (tuning) {
+        if (tuning->concurrency > 0) {
+            vips_concurrency_set(tuning->concurrency);
+        }
+        if (tuning->cache_max >= 0) {
+            vips_cache_set_max(tuning->cache_max);
+        }
+        if (tuning->cache_max_mem >= 0) {
+            vips_cache_set_max_mem((size_t)tuning->cache_max_mem);
+        }
+        if (tuning->cache_max_files >= 0) {
+            vips_cache_set_max_files(tuning->cache_max_files);
+        }
+        if (tuning->leak > 0) {
+            vips_leak_set(TRUE);
+        }
+    }
+    return 0;
+}
+
+void image_resize_render_thread_done(void) {
+    if (libvips_initialized) {
+        vips_thread_shutdown();
+    }
+}
+
+// Ensure parent directory of a file exists
+static int ensure_parent_directory_exists(const image_render_ctx *ctx, const char *file_path) {
+    char *dir_path;
+    char *last_slash;
+    
+    // Copy file path
+    dir_path = apr_pstrdup(ctx->pool, file_path);
+    
+    // Find last slash to get parent directory
+    last_slash = strrchr(dir_path, '/');
+    if (!last_slash) {
+        return 0; // No slash, no directory to create
+    }
+    
+    // Terminate string at last slash to get just the directory path
+    *last_slash = '\0';
+    
+    // Check if directory already exists
+    apr_finfo_t finfo;
+    if (apr_stat(&finfo, dir_path, APR_FINFO_TYPE, ctx->pool) == APR_SUCCESS) {
+        if (finfo.filetype == APR_DIR) {
+            return 0; // Directory already exists
+        }
+        RENDER_ERROR_LOG(ctx, "Path exists but is not a directory: %s", dir_path);
+        return -1;
+    }
+    
+    RENDER_DEBUG_LOG(ctx, "Creating parent directory recursively: %s", dir_path);
+    
+    // Create directory recursively
+    apr_status_t rv = apr_dir_make_recursive(dir_path, 
+                                           APR_FPROT_UREAD | APR_FPROT_UWRITE | APR_FPROT_UEXECUTE |
+                                           APR_FPROT_GREAD | APR_FPROT_GEXECUTE |
+                                           APR_FPROT_WREAD | APR_FPROT_WEXECUTE, 
+                                           ctx->pool);
+    
+    if (rv != APR_SUCCESS) {
+        RENDER_ERROR_LOG(ctx, "Failed to create parent directory: %s (code: %d)", 
+                          dir_path, rv);
+        return -1;
+    }
+    
+    // Ensure permissions are correct for Apache
+    if (chown(dir_path, geteuid(), getegid()) != 0) {
+        RENDER_WARNING_LOG(ctx, "Unable to change directory owner: %s", 
+                          dir_path);
+    }
+    
+    return 0;
+}
+
+// Write an encoded image to the cache. The bytes go to a private temporary file
+// next to the cache entry, published with an atomic rename once complete, so
+// readers never see partial files. The file gets the modification time of its
+// source, which Last-Modified and ETag are derived from.
+int image_resize_write_cache_file(const image_render_ctx *ctx, const char *output_path,
+                                  const void *data, apr_size_t size, apr_time_t mtime,
+                                  int flags) {
+    const char *temp_path;
+    apr_finfo_t finfo;
+    apr_file_t *fd;
+    apr_status_t rv;
+    char errbuf[100];
+    
+    temp_path = apr_psprintf(ctx->pool, "%s.%" APR_PID_T_FMT ".%lx.tmp", output_path,
+                             getpid(), (unsigned long)apr_os_thread_current());
+    
+    RENDER_DEBUG_LOG(ctx, "Writing cache file %s through %s", output_path, temp_path);
+    
+    rv = apr_file_open(&fd, temp_path, APR_WRITE | APR_CREATE | APR_TRUNCATE | APR_BINARY,
+                       APR_OS_DEFAULT, ctx->pool);
+    
+    // The parent directory is only looked at when it is missing, so that
+    // writes into existing directories cost no stat or mkdir
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        if (ensure_parent_directory_exists(ctx, output_path) != 0) {
+            RENDER_ERROR_LOG(ctx, "Failed to create parent directory for cache file");
+            return -1;
+        }
+        rv = apr_file_open(&fd, temp_path, APR_WRITE | APR_CREATE | APR_TRUNCATE | APR_BINARY,
+                           APR_OS_DEFAULT, ctx->pool);
+    }
+    if (rv != APR_SUCCESS) {
+        RENDER_ERROR_LOG(ctx, "Cannot create temporary cache file %s: %s", temp_path,
+                          apr_strerror(rv, errbuf, sizeof(errbuf)));
+        return -1;
+    }
+    
+    rv = apr_file_write_full(fd, data, size, NULL);
+    apr_file_close(fd);
+    if (rv != APR_SUCCESS) {
+        RENDER_ERROR_LOG(ctx, "Cannot write temporary cache file %s: %s", temp_path,
+                          apr_strerror(rv, errbuf, sizeof(errbuf)));
+        apr_file_remove(temp_path, ctx->pool);
+        return -1;
+    }
+    
+    if (mtime && (rv = apr_file_mtime_set(temp_path, mtime, ctx->pool)) != APR_SUCCESS) {
+        RENDER_WARNING_LOG(ctx, "Cannot set modification time of %s: %s", temp_path,
+                            apr_strerror(rv, errbuf, sizeof(errbuf)));
+    }
+    
+    // A re-encode only replaces the entry it was made for: not one evicted since,
+    // nor one rendered from a newer source
+    if ((flags & IMAGE_RENDER_REPLACE) &&
+        (apr_stat(&finfo, output_path, APR_FINFO_MTIME, ctx->pool) != APR_SUCCESS ||
+         finfo.mtime != mtime)) {
+        RENDER_DEBUG_LOG(ctx, "Cache file %s changed during the render, left as is", output_path);
+        apr_file_remove(temp_path, ctx->pool);
+        return IMAGE_SUPERSEDED;
+    }
+    
+    // Publish the complete file under its final name
+    rv = apr_file_rename(temp_path, output_path, ctx->pool);
+    if (rv != APR_SUCCESS) {
+        RENDER_ERROR_LOG(ctx, "Failed to publish cache file %s: %s", output_path,
+                          apr_strerror(rv, errbuf, sizeof(errbuf)));
+        apr_file_remove(temp_path, ctx->pool);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Check that a source image can be rendered: libvips ready, file present, and
+// no more pixels than ImageResizeMaxPixels in the frames to load. Sets the number of
+// frames to load: those kept by ImageResizeMaxFrames for an animated source
+// rendered to GIF or WebP, otherwise 1.
+static int check_source(const image_render_ctx *ctx, const image_resize_config *cfg,
+                        const char *input_path, image_format format,
+                        apr_time_t *mtime, int *pages) {
+    int animated = cfg->max_frames > 1 &&
+                   (format == IMAGE_FORMAT_GIF || format == IMAGE_FORMAT_WEBP);
+    
+    *pages = 1;
+    
+    // Check if libvips is initialized
+    if (!libvips_initialized) {
+        RENDER_ERROR_LOG(ctx, "LibVips not initialized, cannot process image");
+        return -1;
+    }
+    
+    RENDER_DEBUG_LOG(ctx, "Source image path: %s", input_path);
+    
+    // Check if source image exists
+    apr_finfo_t finfo;
+    if (apr_stat(&finfo, input_path, APR_FINFO_TYPE | APR_FINFO_MTIME | APR_FINFO_SIZE, ctx->pool) != APR_SUCCESS) {
+        RENDER_WARNING_LOG(ctx, "Source image not found: %s", input_path);
+        return IMAGE_NOT_FOUND;
+    }
+    *mtime = finfo.mtime;
+    if (ctx->timings) {
+        ctx->timings->source_bytes += finfo.size;
+    }
+    
+    // Reject decompression bombs and count frames from the header alone, before
+    // any pixel is decoded. The header describes the first frame only, and every
+    // frame kept of an animation is decoded, so the budget covers all of them.
+    if (cfg->max_pixels > 0 || animated) {
+        VipsImage *header = vips_image_new_from_file(input_path,
+                                                     "access", VIPS_ACCESS_SEQUENTIAL,
+                                                     NULL);
+        if (!header) {
+            RENDER_ERROR_LOG(ctx, "Failed to read image header: %s", vips_error_buffer());
+            vips_error_clear();
+            return -1;
+        }
+        
+        apr_int64_t pixels = (apr_int64_t)vips_image_get_width(header) * vips_image_get_height(header);
+        int frames = vips_image_get_n_pages(header);
+        g_object_unref(header);
+        
+        // Longer animations are cut, so that memory stays within MaxFrames frames
+        if (animated && frames > 1) {
+            *pages = frames < cfg->max_frames ? frames : cfg->max_frames;
+            if (frames > *pages) {
+                RENDER_INFO_LOG(ctx, "Keeping %d of the %d frames of %s", *pages, frames, input_path);
+            }
+        }
+        
+        pixels *= *pages;
+        if (cfg->max_pixels > 0 && pixels > cfg->max_pixels) {
+            RENDER_WARNING_LOG(ctx, "Source image has %" APR_INT64_T_FMT " pixels in %d frames, more than the %"
+                                 APR_INT64_T_FMT " allowed: %s", pixels, *pages, cfg->max_pixels, input_path);
+            return IMAGE_TOO_LARGE;
+        }
+    }
+    
+    return 0;
+}
+
+// Name of a source for vips_thumbnail(), loading all the frames to keep. Each
+// frame is then resized on its own, as libvips handles the page-height of
+// animations, and the GIF and WebP savers write them back as an animation.
+static const char *source_load_name(const image_render_ctx *ctx, const char *input_path, int pages) {
+    return pages > 1 ? apr_psprintf(ctx->pool, "%s[n=%d]", input_path, pages) : input_path;
+}
+
+// Encode a resized image, write it to the cache and optionally hand the bytes over.
+// The encoder effort comes from the ImageResize*Effort settings, or is the
+// lowest one with IMAGE_RENDER_FAST_ENCODE.
+static int save_image(const image_render_ctx *ctx, const image_resize_config *cfg,
+                      image_format format, int quality, VipsImage *out, const char *output_path,
+                      apr_time_t source_mtime, int flags, image_buffer *result) {
+    void *data = NULL;
+    size_t size = 0;
+    int failed;
+    int fast = (flags & IMAGE_RENDER_FAST_ENCODE) != 0;
+    apr_time_t start = image_resize_clock();
+    
+    RENDER_DEBUG_LOG(ctx, "Output path: %s%s", output_path, fast ? " (fast encode)" : "");
+    
+    // Encode in memory according to format with appropriate compression
+    switch (format) {
+    case IMAGE_FORMAT_JPEG:
+        // JPEG saving with mozjpeg (if available)
+        failed = vips_jpegsave_buffer(out, &data, &size, 
+                                      "Q", quality,
+                                      "optimize_coding", !fast,
+                                      "interlace", !fast,
+                                      "trellis_quant", cfg->jpeg_trellis && !fast,
+                                      NULL);
+        break;
+    case IMAGE_FORMAT_PNG:
+        // PNG saving with integrated libimagequant optimization
+        failed = vips_pngsave_buffer(out, &data, &size, 
+                                     "palette", !fast,          // Use color palette
+                                     "Q", quality,
+                                     "compression", fast ? 1 : cfg->png_effort,
+                                     "interlace", TRUE,         // Progressive loading
+                                     NULL);
+        break;
+    case IMAGE_FORMAT_WEBP:
+        // WebP saving ("reduction_effort" is the name libvips 8.9 knows,
+        // later versions alias it to "effort")
+        failed = vips_webpsave_buffer(out, &data, &size, "Q", quality,
+                                      "reduction_effort", fast ? 0 : cfg->webp_effort,
+                                      NULL);
+        break;
+    case IMAGE_FORMAT_GIF:
+        failed = vips_gifsave_buffer(out, &data, &size, 
+                                     "interlace", TRUE,
+                                     NULL);
+        break;
+    case IMAGE_FORMAT_AVIF:
+        // AVIF is HEIF with AV1 compression
+        failed = vips_heifsave_buffer(out, &data, &size,
+                                      "Q", quality,
+                                      "compression", VIPS_FOREIGN_HEIF_COMPRESSION_AV1,
+                                      NULL);
+        break;
+    default:
+        RENDER_WARNING_LOG(ctx, "Unsupported format: %s, defaulting to JPEG", image_format_name(format));
+        // Default to JPEG
+        failed = vips_jpegsave_buffer(out, &data, &size, "Q", quality, NULL);
+        break;
+    }
+    
+    image_render_phase_end(ctx, IMAGE_PHASE_ENCODE, start);
+    if (failed) {
+        RENDER_ERROR_LOG(ctx, "Image save failed (format %s): %s", image_format_name(format),
+                          vips_error_buffer());
+        vips_error_clear();
+        return -1;
+    }
+    
+    RENDER_INFO_LOG(ctx, "Output file size: %" APR_SIZE_T_FMT " bytes", size);
+    if (ctx->timings) {
+        ctx->timings->output_bytes += size;
+    }
+    
+    // Write the cache entry from the encoded bytes
+    start = image_resize_clock();
+    failed = image_resize_write_cache_file(ctx, output_path, data, size, source_mtime, flags);
+    image_render_phase_end(ctx, IMAGE_PHASE_WRITE, start);
+    if (failed) {
+        g_free(data);
+        return failed == IMAGE_SUPERSEDED ? failed : -1;
+    }
+    
+    // Hand the encoded bytes over to the caller, if it wants to stream them
+    if (result) {
+        result->data = data;
+        result->size = size;
+        result->mtime = source_mtime;
+    } else {
+        g_free(data);
+    }
+    
+    return 0;
+}
+
+// Crop strategy of vips_thumbnail() for a fit mode
+static VipsInteresting fit_interesting(image_fit fit) {
+    switch (fit) {
+    case IMAGE_FIT_COVER:        return VIPS_INTERESTING_ATTENTION;
+    case IMAGE_FIT_COVER_CENTER: return VIPS_INTERESTING_CENTRE;
+    default:                     return VIPS_INTERESTING_NONE;
+    }
+}
+
+// Process an image with libvips - resize and compress according to format
+int image_resize_process_image(const image_render_ctx *ctx, const image_resize_config *cfg, 
+                               const image_request *req, const char *output_path,
+                               int flags, image_buffer *result) {
+    const char *input_path;
+    VipsImage *out = NULL;
+    apr_time_t source_mtime;
+    apr_time_t start = image_resize_clock();
+    int status, pages;
+    
+    // Build path to source image
+    input_path = apr_pstrcat(ctx->pool, cfg->image_dir, "/", req->filename, NULL);
+    status = check_source(ctx, cfg, input_path, req->format, &source_mtime, &pages);
+    if (status != 0) {
+        return status;
+    }
+    
+    // Load and resize in one step. vips_thumbnail() fits the image inside
+    // width x height like the min(scale_x, scale_y) factor did, and picks the
+    // cheapest decoder path: DCT-domain shrink for JPEG, decode-time scaling for
+    // WebP/HEIF, and only then a final vips_resize() on the reduced image.
+    // The source is always opened with sequential access, so libvips streams
+    // it through the pipeline instead of buffering the whole decoded image.
+    // EXIF orientation is left as is, as with a plain load.
+    // With a cover fit, the image fills the box and the overflow is cropped,
+    // keeping the most interesting region (smart crop) or the center.
+    if (vips_thumbnail(source_load_name(ctx, input_path, pages), &out, req->width,
+                       "height", req->height,
+                       "no_rotate", TRUE,
+                       "crop", fit_interesting(req->fit),
+                       NULL)) {
+        RENDER_ERROR_LOG(ctx, "Failed to load and resize image: %s", vips_error_buffer());
+        vips_error_clear();
+        return -1;
+    }
+    image_render_phase_end(ctx, IMAGE_PHASE_DECODE, start);
+    
+    RENDER_INFO_LOG(ctx, "Image resized to: %dx%d", 
+                      vips_image_get_width(out), vips_image_get_height(out));
+    
+    status = save_image(ctx, cfg, req->format, image_request_quality(req, cfg), out, output_path,
+                        source_mtime, flags, result);
+    
+    // Clean up
+    g_object_unref(out);
+    
+    return status;
+}
+
+// A batch render: the outputs of one decoded source, taken in turn by the threads
+typedef struct {
+    const image_resize_config *cfg;
+    image_format format;
+    VipsImage *decoded;          // Shared decoded source, read only
+    apr_time_t source_mtime;     // Modification time of the source
+    image_variant *variants;     // Outputs to produce
+    apr_uint32_t nvariants;
+    volatile apr_uint32_t next;  // Next output to take
+} variant_batch;
+
+// A thread of a batch render
+typedef struct {
+    variant_batch *batch;
+    image_render_ctx ctx;        // Private pool and log of the thread
+    int own_pool;                // The pool is the thread's own, not the caller's
+} variant_worker;
+
+// Resize the shared decoded source to one variant, then encode and write it
+static void render_variant(const image_render_ctx *ctx, const variant_batch *batch,
+                           image_variant *variant) {
+    VipsImage *out = NULL;
+    
+    if (vips_thumbnail_image(batch->decoded, &out, variant->width,
+                             "height", variant->height,
+                             "no_rotate", TRUE,
+                             NULL)) {
+        RENDER_ERROR_LOG(ctx, "Failed to resize image: %s", vips_error_buffer());
+        vips_error_clear();
+        variant->status = -1;
+        return;
+    }
+    
+    RENDER_INFO_LOG(ctx, "Image resized to: %dx%d", 
+                      vips_image_get_width(out), vips_image_get_height(out));
+    
+    variant->status = save_image(ctx, batch->cfg, batch->format, batch->cfg->quality, out,
+                                 variant->output_path, batch->source_mtime, 0, NULL);
+    g_object_unref(out);
+}
+
+// Render the outputs of a batch until none is left
+static void render_variants(variant_worker *worker) {
+    variant_batch *batch = worker->batch;
+    image_render_ctx ctx = worker->ctx;
+    apr_uint32_t i;
+    
+    // A thread of its own renders each output in a subpool cleared after it,
+    // so a long batch does not grow its pool
+    if (worker->own_pool && apr_pool_create(&ctx.pool, worker->ctx.pool) != APR_SUCCESS) {
+        ctx.pool = worker->ctx.pool;
+    }
+    
+    while ((i = apr_atomic_inc32(&batch->next)) < batch->nvariants) {
+        render_variant(&ctx, batch, &batch->variants[i]);
+        if (ctx.pool != worker->ctx.pool) {
+            apr_pool_clear(ctx.pool);
+        }
+    }
+}
+
+static void * APR_THREAD_FUNC render_variant_thread(apr_thread_t *thread, void *data) {
+    render_variants((variant_worker *)data);
+    vips_thread_shutdown();
+    return NULL;
+}
+
+// Render several sizes of one source from a single decode
+int image_resize_process_variants(const image_render_ctx *ctx, const image_resize_config *cfg,
+                                  const char *filename, image_format format,
+                                  image_variant *variants, int nvariants, int max_threads) {
+    const char *input_path;
+    VipsImage *thumb = NULL;
+    VipsImage *decoded;
+    int box_width = 0, box_height = 0;
+    apr_time_t source_mtime = 0;
+    apr_time_t start = image_resize_clock();
+    int status, pages, nthreads, i;
+    
+    input_path = apr_pstrcat(ctx->pool, cfg->image_dir, "/", filename, NULL);
+    status = check_source(ctx, cfg, input_path, format, &source_mtime, &pages);
+    
+    // Decode once, shrunk on load to the box of the largest variant: every
+    // variant fits inside it, so each one is a downscale of this image
+    if (status == 0) {
+        for (i = 0; i < nvariants; i++) {
+            box_width = variants[i].width > box_width ? variants[i].width : box_width;
+            box_height = variants[i].height > box_height ? variants[i].height : box_height;
+        }
+        if (vips_thumbnail(source_load_name(ctx, input_path, pages), &thumb, box_width,
+                           "height", box_height,
+                           "no_rotate", TRUE,
+                           NULL)) {
+            RENDER_ERROR_LOG(ctx, "Failed to load and resize image: %s", vips_error_buffer());
+            vips_error_clear();
+            status = -1;
+        }
+    }
+    
+    // The variants read the pixels concurrently, so they must be decoded once
+    // into memory rather than streamed from the file by each of them
+    if (status == 0) {
+        decoded = vips_image_copy_memory(thumb);
+        g_object_unref(thumb);
+        if (!decoded) {
+            RENDER_ERROR_LOG(ctx, "Failed to decode image: %s", vips_error_buffer());
+            vips_error_clear();
+            status = -1;
+        }
+    }
+    
+    if (status != 0) {
+        for (i = 0; i < nvariants; i++) {
+            variants[i].status = status;
+        }
+        return status;
+    }
+    image_render_phase_end(ctx, IMAGE_PHASE_DECODE, start);
+    
+    nthreads = max_threads < nvariants ? max_threads : nvariants;
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    RENDER_DEBUG_LOG(ctx, "Decoded %s once for %d variants at %dx%d, rendered on %d threads",
+                      filename, nvariants, vips_image_get_width(decoded),
+                      vips_image_get_height(decoded), nthreads);
+    
+    // The variants are taken in turn by up to max_threads threads, the calling
+    // thread being one of them. The other threads get their own top-level
+    // pools, as subpools of the caller's pool would share its unlocked
+    // allocator, and only the calling thread adds to the timings.
+    variant_batch batch;
+    variant_worker *workers = apr_pcalloc(ctx->pool, nthreads * sizeof(variant_worker));
+    apr_thread_t **threads = apr_pcalloc(ctx->pool, nthreads * sizeof(apr_thread_t *));
+    
+    batch.cfg = cfg;
+    batch.format = format;
+    batch.decoded = decoded;
+    batch.source_mtime = source_mtime;
+    batch.variants = variants;
+    batch.nvariants = nvariants;
+    batch.next = 0;
+    for (i = 0; i < nvariants; i++) {
+        variants[i].status = -1;
+    }
+    
+    for (i = 0; i < nthreads; i++) {
+        workers[i].batch = &batch;
+        workers[i].ctx = *ctx;
+        if (i > 0) {
+            workers[i].ctx.timings = NULL;
+            workers[i].own_pool = 1;
+            if (apr_pool_create(&workers[i].ctx.pool, NULL) != APR_SUCCESS) {
+                workers[i].ctx.pool = NULL;
+            } else if (apr_thread_create(&threads[i], NULL, render_variant_thread, &workers[i],
+                                         workers[i].ctx.pool) != APR_SUCCESS) {
+                threads[i] = NULL; // The other threads take its share
+            }
+        }
+    }
+    
+    render_variants(&workers[0]);
+    
+    for (i = 1; i < nthreads; i++) {
+        apr_status_t rv;
+        if (threads[i]) {
+            apr_thread_join(&rv, threads[i]);
+        }
+        if (workers[i].ctx.pool) {
+            apr_pool_destroy(workers[i].ctx.pool);
+        }
+    }
+    
+    g_object_unref(decoded);
+    
+    return 0;
+}
@@ -0,0 +1,206 @@
+/**
+ * image_resize_render.h
+ *
+ * Image rendering pipeline of mod_image_resize: load, resize, encode and
+ * write to the cache. Depends on APR and libvips only, so that it can be
+ * driven by a request, a background thread or a standalone tool.
+ */
+
+#ifndef IMAGE_RESIZE_RENDER_H
+#define IMAGE_RESIZE_RENDER_H
+
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_file_io.h>
+#include <apr_file_info.h>
+#include <apr_tables.h>
+#include <time.h>
+
+#include "image_resize_url.h"
+
+// Output size of a variant
+typedef struct {
+    int width;                   // Target width
+    int height;                  // Target height
+} image_resize_size;
+
+// Layouts of the cache directory
+#define IMAGE_CACHE_LAYOUT_TREE 0    // Mirror of the source tree: WIDTHxHEIGHT_path/to/file.ext
+#define IMAGE_CACHE_LAYOUT_HASHED 1  // Hash of the render parameters, in two levels of fan-out directories
+
+// Handling of sizes missing from ImageResizeAllowedSizes
+#define IMAGE_SNAP_OFF 0             // Refused with 400
+#define IMAGE_SNAP_REDIRECT 1        // Redirected to the nearest allowed size
+#define IMAGE_SNAP_SERVE 2           // Answered with the nearest allowed size
+
+// Configuration structure
+typedef struct {
+    const char *image_dir;       // Source image directory
+    const char *cache_dir;       // Cache directory
+    int quality;                 // Universal image quality (0-100)
+    int cache_max_age;           // Cache lifetime in seconds
+    int enable_mutex;            // Enable cache mutex (0/1)
+    int check_source_mtime;      // Check if source image is newer than cached image (0/1)
+    int mtime_ttl;               // Seconds to trust a source modification time (0 = always stat)
+    int render_timeout;          // Seconds to wait for a render done by another process
+    int stream_render;           // Send rendered images from memory on a cache miss (0/1)
+    apr_int64_t max_pixels;      // Largest source image accepted, in pixels (0 = no limit)
+    int max_frames;              // Frames of an animation kept (0 or 1 = first frame only)
+    int negative_cache_ttl;      // Seconds to remember missing source images (0 = disabled)
+    apr_array_header_t *prewarm_sizes; // Variants rendered in the background (image_resize_size)
+    int render_siblings;         // Render the prewarm sizes along with a cache miss (0/1)
+    int negotiate;               // Pick WebP or AVIF from the Accept header (0/1)
+    int cache_layout;            // Layout of the cache directory (IMAGE_CACHE_LAYOUT_*)
+    apr_off_t cache_max_bytes;   // Size budget of the cache directory (0 = unlimited)
+    int fast_path;               // Serve cache hits from translate_name (0/1)
+    int png_effort;              // zlib compression level of PNG renders (0-9)
+    int webp_effort;             // Encoder effort of WebP renders (0-6)
+    int jpeg_trellis;            // Trellis quantization of JPEG renders, with mozjpeg (0/1)
+    int two_tier;                // Fast encode on a miss, full effort in the background (0/1)
+    apr_array_header_t *allowed_sizes; // Sizes that may be requested (image_resize_size, NULL = any)
+    int snap_sizes;              // Handling of the other sizes (IMAGE_SNAP_*)
+    int max_dimension;           // Largest width or height that may be requested (0 = no limit)
+} image_resize_config;
+
+// Quality of a render: the one of the URL, else the directory default
+static APR_INLINE int image_request_quality(const image_request *req, const image_resize_config *cfg) {
+    return req->quality ? req->quality : cfg->quality;
+}
+
+// Special return codes of the image processing functions (0 is success, -1 an error)
+#define IMAGE_NOT_FOUND -2       // Source image does not exist
+#define IMAGE_TOO_LARGE -3       // Source image exceeds ImageResizeMaxPixels
+#define IMAGE_BUSY -4            // Render refused by admission control, retry later
+#define IMAGE_SUPERSEDED -5      // Cache entry replaced or removed during the render, left as is
+
+// Flags of image_resize_process_image()
+#define IMAGE_RENDER_FAST_ENCODE 0x01 // Encode at the lowest effort (first tier of ImageResizeTwoTierEncode)
+#define IMAGE_RENDER_REPLACE 0x02     // Only replace an entry rendered from the same source
+
+// Encoded image produced by a render
+typedef struct {
+    void* data;                  // Encoded bytes, allocated by libvips (g_free)
+    size_t size;                 // Number of bytes
+    apr_time_t mtime;            // Modification time of the source
+} image_buffer;
+
+// Log levels of render messages (same values as the APLOG_* levels)
+#define RENDER_LOG_ERR 3
+#define RENDER_LOG_WARNING 4
+#define RENDER_LOG_INFO 6
+#define RENDER_LOG_DEBUG 7
+
+// Timed phases of a request. libvips pipelines are lazy: most of the decoding
+// and resizing runs while the encoder pulls pixels, so it is counted in ENCODE.
+typedef enum {
+    IMAGE_PHASE_PARSE = 0,       // URL parsing and format negotiation
+    IMAGE_PHASE_CACHE,           // Memory and disk cache lookups
+    IMAGE_PHASE_LOCK,            // Waits for the render locks and render slots
+    IMAGE_PHASE_DECODE,          // Opening the source, shrink-on-load and batch decodes
+    IMAGE_PHASE_ENCODE,          // Resizing and encoding the output
+    IMAGE_PHASE_WRITE,           // Writing the cache file
+    IMAGE_PHASE_SEND,            // Passing the response to the output filters
+    IMAGE_PHASE_COUNT
+} image_phase;
+
+// Measurements of a request, filled by the render pipeline and the handler
+typedef struct {
+    apr_interval_time_t phases[IMAGE_PHASE_COUNT]; // Time spent in each phase
+    unsigned int seen;           // Bit mask of the phases entered
+    const char *cache_result;    // "memory", "disk", "render" or "wait", NULL if unknown
+    apr_off_t source_bytes;      // Size of the source rendered
+    apr_off_t output_bytes;      // Size of the image rendered
+    int lock_waits;              // Waits on another thread, process or render slot
+} image_render_timings;
+
+// Monotonic clock in microseconds, for the phase timings
+static APR_INLINE apr_time_t image_resize_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (apr_time_t)ts.tv_sec * APR_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+// Context of a render: where it allocates and where it logs
+typedef struct image_render_ctx image_render_ctx;
+struct image_render_ctx {
+    apr_pool_t *pool;            // Pool for the allocations of the render
+    int log_level;               // Most verbose level worth formatting
+    void (*log)(const image_render_ctx *ctx, int level, const char *msg); // Log sink
+    void *log_data;              // Request, server or file of the log sink
+    int background;              // Render not tied to a request, exempt from admission control
+    image_render_timings *timings; // Where the phases of the render are timed, NULL if not timed
+};
+
+// Add the time elapsed since start, from image_resize_clock(), to a phase
+static APR_INLINE void image_render_phase_end(const image_render_ctx *ctx, image_phase phase,
+                                              apr_time_t start) {
+    if (ctx->timings) {
+        ctx->timings->phases[phase] += image_resize_clock() - start;
+        ctx->timings->seen |= 1u << phase;
+    }
+}
+
+// Logging macros of the render pipeline, formatted only when the level is enabled
+#define RENDER_LOG(ctx, level, fmt, ...) \
+    do { \
+        if ((level) <= (ctx)->log_level) { \
+            (ctx)->log((ctx), (level), apr_psprintf((ctx)->pool, fmt, ##__VA_ARGS__)); \
+        } \
+    } while (0)
+
+#define RENDER_ERROR_LOG(ctx, fmt, ...) \
+    RENDER_LOG(ctx, RENDER_LOG_ERR, "ERROR: " fmt, ##__VA_ARGS__)
+#define RENDER_WARNING_LOG(ctx, fmt, ...) \
+    RENDER_LOG(ctx, RENDER_LOG_WARNING, "WARNING: " fmt, ##__VA_ARGS__)
+#define RENDER_INFO_LOG(ctx, fmt, ...) \
+    RENDER_LOG(ctx, RENDER_LOG_INFO, "INFO: " fmt, ##__VA_ARGS__)
+#define RENDER_DEBUG_LOG(ctx, fmt, ...) \
+    RENDER_LOG(ctx, RENDER_LOG_DEBUG, "DEBUG: " fmt, ##__VA_ARGS__)
+
+// Process-wide libvips settings, negative values keep the libvips defaults
+typedef struct {
+    int concurrency;             // Worker threads of each libvips pipeline
+    int cache_max;               // Operations kept in the libvips operation cache
+    apr_off_t cache_max_mem;     // Memory held by the operation cache, in bytes
+    int cache_max_files;         // Files kept open by the operation cache
+    int leak;                    // Report leaked libvips objects at exit (0/1)
+} image_vips_tuning;
+
+// Initialize libvips and apply the given settings (may be NULL) - returns 0 on success
+int image_resize_render_init(const char *name, const image_vips_tuning *tuning);
+
+// Release the libvips resources of a thread which rendered images
+void image_resize_render_thread_done(void);
+
+// Resize and encode the source of a request, and write it to output_path, as
+// told by the IMAGE_RENDER_* flags. When result is not NULL, the encoded bytes
+// are handed over to the caller.
+int image_resize_process_image(const image_render_ctx *ctx, const image_resize_config *cfg,
+                               const image_request *req, const char *output_path,
+                               int flags, image_buffer *result);
+
+// One output of a batch render
+typedef struct {
+    int width;                   // Target width
+    int height;                  // Target height
+    const char *output_path;     // Cache file to write
+    int status;                  // Result of the render of this output
+} image_variant;
+
+// Render several sizes of one source from a single decode, encoding the outputs
+// on at most max_threads threads, the calling thread included. Sets the status of
+// every variant, and returns the status of the load (0, -1, IMAGE_NOT_FOUND or
+// IMAGE_TOO_LARGE).
+int image_resize_process_variants(const image_render_ctx *ctx, const image_resize_config *cfg,
+                                  const char *filename, image_format format,
+                                  image_variant *variants, int nvariants, int max_threads);
+
+// Write encoded bytes to a cache file, atomically, with the given modification
+// time (0 to keep the current time). With IMAGE_RENDER_REPLACE in flags, the file
+// is only replaced if it has that modification time, else IMAGE_SUPERSEDED is
+// returned.
+int image_resize_write_cache_file(const image_render_ctx *ctx, const char *output_path,
+                                  const void *data, apr_size_t size, apr_time_t mtime,
+                                  int flags);
+
+#endif /* IMAGE_RESIZE_RENDER_H */
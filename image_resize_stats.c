@@ -0,0 +1,252 @@
+/**
+ * image_resize_stats.c
+ *
+ * Request instrumentation. Each request times its phases with a monotonic
+ * clock. When it is logged, the timings are published in r->notes for
+ * LogFormat and added to counters and histograms in a segment shared by all
+ * children, which the image-resize-status handler reports as JSON.
+ */
+
+#include "mod_image_resize.h"
+#include <apr_atomic.h>
+
+// Histogram buckets: bucket i counts durations below 2^i microseconds, the
+// last one everything from about 4 seconds up
+#define STATS_BUCKETS 24
+
+// Names of the phases, in r->notes ("image-resize-<name>") and in the status
+static const char *const stats_phase_names[IMAGE_PHASE_COUNT] = {
+    "parse", "cache", "lock", "decode", "encode", "write", "send"
+};
+
+// Distribution of the durations of a phase
+typedef struct {
+    volatile apr_uint64_t count;             // Requests which entered the phase
+    volatile apr_uint64_t total_us;          // Sum of their durations
+    volatile apr_uint64_t buckets[STATS_BUCKETS];
+} stats_histogram;
+
+// Counters shared by all children, updated with atomic operations
+typedef struct {
+    volatile apr_uint64_t requests;          // Image requests logged
+    volatile apr_uint64_t memory_hits;       // Served from the memory cache
+    volatile apr_uint64_t disk_hits;         // Served from the disk cache
+    volatile apr_uint64_t renders;           // Rendered by the request
+    volatile apr_uint64_t waits;             // Rendered by another thread or process
+    volatile apr_uint64_t not_modified;      // Answered with 304
+    volatile apr_uint64_t client_errors;     // Answered with another 4xx
+    volatile apr_uint64_t rejected;          // Answered with 503 by admission control
+    volatile apr_uint64_t server_errors;     // Answered with another 5xx
+    volatile apr_uint64_t bytes_sent;        // Response bodies
+    volatile apr_uint64_t source_bytes;      // Sources rendered
+    volatile apr_uint64_t output_bytes;      // Images rendered from them
+    volatile apr_uint64_t lock_waits;        // Waits on a render lock or slot
+    stats_histogram total;                   // Whole requests, from the handler to the log
+    stats_histogram phases[IMAGE_PHASE_COUNT];
+} stats_shared;
+
+// Instrumentation of one request, kept in its request_config
+typedef struct {
+    image_render_timings timings;
+    apr_time_t start;            // image_resize_clock() when the handler took the request
+} stats_request;
+
+static apr_shm_t *stats_shm = NULL;
+static stats_shared *stats = NULL;
+
+// Create the shared counters - called from post_config, before forking
+apr_status_t image_resize_stats_create(apr_pool_t *p, server_rec *s) {
+    apr_status_t rv;
+
+    stats = NULL;
+    rv = apr_shm_create(&stats_shm, sizeof(stats_shared), NULL, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                    "mod_image_resize: unable to create request statistics shared memory");
+        return rv;
+    }
+    stats = apr_shm_baseaddr_get(stats_shm);
+    memset(stats, 0, sizeof(stats_shared));
+
+    return APR_SUCCESS;
+}
+
+// Start timing a request taken by the image handler or its fast path. A
+// request falling through from the fast path keeps its first timings.
+image_render_timings *image_resize_stats_begin(request_rec *r) {
+    stats_request *rec = ap_get_module_config(r->request_config, &image_resize_module);
+
+    if (rec) {
+        return &rec->timings;
+    }
+    rec = apr_pcalloc(r->pool, sizeof(stats_request));
+    rec->start = image_resize_clock();
+    ap_set_module_config(r->request_config, &image_resize_module, rec);
+    return &rec->timings;
+}
+
+// Timings of a request, NULL if it was not taken by the image handler
+image_render_timings *image_resize_stats_timings(request_rec *r) {
+    stats_request *rec = ap_get_module_config(r->request_config, &image_resize_module);
+    return rec ? &rec->timings : NULL;
+}
+
+static void stats_histogram_add(stats_histogram *h, apr_interval_time_t duration) {
+    apr_uint64_t us = duration > 0 ? (apr_uint64_t)duration : 0;
+    int bucket = 0;
+
+    while (bucket < STATS_BUCKETS - 1 && (us >> bucket) != 0) {
+        bucket++;
+    }
+    apr_atomic_inc64(&h->count);
+    apr_atomic_add64(&h->total_us, us);
+    apr_atomic_inc64(&h->buckets[bucket]);
+}
+
+// Publish the timings of a request in its notes and add them to the shared
+// counters - log_transaction hook, run before mod_log_config
+int image_resize_stats_log(request_rec *r) {
+    stats_request *rec = NULL;
+    apr_interval_time_t total;
+    int i;
+
+    // Internal redirects log the first request but time the last one
+    for (; r; r = r->next) {
+        rec = ap_get_module_config(r->request_config, &image_resize_module);
+        if (rec) {
+            break;
+        }
+    }
+    if (!rec) {
+        return DECLINED;
+    }
+    total = image_resize_clock() - rec->start;
+
+    for (i = 0; i < IMAGE_PHASE_COUNT; i++) {
+        if (rec->timings.seen & (1u << i)) {
+            apr_table_setn(r->notes, apr_pstrcat(r->pool, "image-resize-", stats_phase_names[i], NULL),
+                           apr_psprintf(r->pool, "%" APR_TIME_T_FMT, rec->timings.phases[i]));
+        }
+    }
+    apr_table_setn(r->notes, "image-resize-total", apr_psprintf(r->pool, "%" APR_TIME_T_FMT, total));
+    if (rec->timings.cache_result) {
+        apr_table_setn(r->notes, "image-resize-cache", rec->timings.cache_result);
+    }
+
+    if (!stats) {
+        return DECLINED;
+    }
+
+    apr_atomic_inc64(&stats->requests);
+    if (rec->timings.cache_result) {
+        switch (rec->timings.cache_result[0]) {
+        case 'm': apr_atomic_inc64(&stats->memory_hits); break;
+        case 'd': apr_atomic_inc64(&stats->disk_hits); break;
+        case 'r': apr_atomic_inc64(&stats->renders); break;
+        case 'w': apr_atomic_inc64(&stats->waits); break;
+        }
+    }
+    if (r->status == HTTP_NOT_MODIFIED) {
+        apr_atomic_inc64(&stats->not_modified);
+    } else if (r->status == HTTP_SERVICE_UNAVAILABLE) {
+        apr_atomic_inc64(&stats->rejected);
+    } else if (ap_is_HTTP_CLIENT_ERROR(r->status)) {
+        apr_atomic_inc64(&stats->client_errors);
+    } else if (ap_is_HTTP_SERVER_ERROR(r->status)) {
+        apr_atomic_inc64(&stats->server_errors);
+    }
+    apr_atomic_add64(&stats->bytes_sent, r->bytes_sent);
+    apr_atomic_add64(&stats->source_bytes, rec->timings.source_bytes);
+    apr_atomic_add64(&stats->output_bytes, rec->timings.output_bytes);
+    apr_atomic_add64(&stats->lock_waits, rec->timings.lock_waits);
+
+    stats_histogram_add(&stats->total, total);
+    for (i = 0; i < IMAGE_PHASE_COUNT; i++) {
+        if (rec->timings.seen & (1u << i)) {
+            stats_histogram_add(&stats->phases[i], rec->timings.phases[i]);
+        }
+    }
+
+    return DECLINED;
+}
+
+static void stats_print_histogram(request_rec *r, const char *name, stats_histogram *h) {
+    int i;
+
+    ap_rprintf(r, "    \"%s\": {\"count\": %" APR_UINT64_T_FMT ", \"total_us\": %" APR_UINT64_T_FMT
+               ", \"buckets\": [", name, apr_atomic_read64(&h->count), apr_atomic_read64(&h->total_us));
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        ap_rprintf(r, "%s%" APR_UINT64_T_FMT, i ? ", " : "", apr_atomic_read64(&h->buckets[i]));
+    }
+    ap_rputs("]}", r);
+}
+
+// Report the shared counters as JSON - handler of "image-resize-status"
+int image_resize_status_handler(request_rec *r) {
+    apr_uint64_t disk_hits, disk_misses, evictions;
+    apr_uint64_t mem_hits, mem_misses, mem_stores, mem_evictions;
+    apr_uint64_t hits, lookups, source_bytes, output_bytes;
+    int i;
+
+    if (!r->handler || strcmp(r->handler, "image-resize-status") != 0) {
+        return DECLINED;
+    }
+    if (r->method_number != M_GET) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    if (!stats) {
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    image_resize_janitor_stats(&disk_hits, &disk_misses, &evictions);
+    image_resize_memcache_stats(&mem_hits, &mem_misses, &mem_stores, &mem_evictions);
+
+    hits = apr_atomic_read64(&stats->memory_hits) + apr_atomic_read64(&stats->disk_hits);
+    lookups = hits + apr_atomic_read64(&stats->renders) + apr_atomic_read64(&stats->waits);
+    source_bytes = apr_atomic_read64(&stats->source_bytes);
+    output_bytes = apr_atomic_read64(&stats->output_bytes);
+
+    ap_set_content_type(r, "application/json");
+    apr_table_setn(r->headers_out, "Cache-Control", "no-store");
+    if (r->header_only) {
+        return OK;
+    }
+
+    ap_rputs("{\n", r);
+    ap_rprintf(r, "  \"requests\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->requests));
+    ap_rprintf(r, "  \"memory_hits\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->memory_hits));
+    ap_rprintf(r, "  \"disk_hits\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->disk_hits));
+    ap_rprintf(r, "  \"renders\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->renders));
+    ap_rprintf(r, "  \"render_waits\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->waits));
+    ap_rprintf(r, "  \"hit_ratio\": %.4f,\n", lookups ? (double)hits / lookups : 0.0);
+    ap_rprintf(r, "  \"not_modified\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->not_modified));
+    ap_rprintf(r, "  \"client_errors\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->client_errors));
+    ap_rprintf(r, "  \"rejected\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->rejected));
+    ap_rprintf(r, "  \"server_errors\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->server_errors));
+    ap_rprintf(r, "  \"bytes_sent\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->bytes_sent));
+    ap_rprintf(r, "  \"source_bytes\": %" APR_UINT64_T_FMT ",\n", source_bytes);
+    ap_rprintf(r, "  \"output_bytes\": %" APR_UINT64_T_FMT ",\n", output_bytes);
+    ap_rprintf(r, "  \"bytes_saved\": %" APR_INT64_T_FMT ",\n", (apr_int64_t)(source_bytes - output_bytes));
+    ap_rprintf(r, "  \"lock_waits\": %" APR_UINT64_T_FMT ",\n", apr_atomic_read64(&stats->lock_waits));
+    ap_rprintf(r, "  \"disk_cache\": {\"hits\": %" APR_UINT64_T_FMT ", \"misses\": %" APR_UINT64_T_FMT
+               ", \"evictions\": %" APR_UINT64_T_FMT "},\n",
+               disk_hits, disk_misses, evictions);
+    ap_rprintf(r, "  \"memory_cache\": {\"hits\": %" APR_UINT64_T_FMT ", \"misses\": %" APR_UINT64_T_FMT
+               ", \"stores\": %" APR_UINT64_T_FMT ", \"evictions\": %" APR_UINT64_T_FMT "},\n",
+               mem_hits, mem_misses, mem_stores, mem_evictions);
+
+    // Upper bounds of the histogram buckets, the last one is open
+    ap_rputs("  \"bucket_bounds_us\": [", r);
+    for (i = 0; i < STATS_BUCKETS - 1; i++) {
+        ap_rprintf(r, "%s%lu", i ? ", " : "", 1ul << i);
+    }
+    ap_rputs("],\n  \"latency\": {\n", r);
+    stats_print_histogram(r, "total", &stats->total);
+    for (i = 0; i < IMAGE_PHASE_COUNT; i++) {
+        ap_rputs(",\n", r);
+        stats_print_histogram(r, stats_phase_names[i], &stats->phases[i]);
+    }
+    ap_rputs("\n  }\n}\n", r);
+
+    return OK;
+}
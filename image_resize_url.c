@@ -0,0 +1,258 @@
+/**
+ * image_resize_url.c
+ *
+ * Single-pass, allocation-free parser for mod_image_resize URLs.
+ * Accepts the same URLs as the former regular expression
+ * "/([0-9]+)x([0-9]+)/(.+\.[^/]+)$", matched leftmost-first, plus
+ * comma-separated options after the size.
+ */
+
+#include "image_resize_url.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+// Parse a positive decimal number. Returns a pointer past its digits, or NULL
+// if there is no digit, the value is zero, or it overflows an int.
+static const char *parse_number(const char *p, int *value) {
+    const char *start = p;
+    int v = 0;
+
+    while (*p >= '0' && *p <= '9') {
+        int digit = *p - '0';
+        if (v > (INT_MAX - digit) / 10) {
+            return NULL;
+        }
+        v = v * 10 + digit;
+        p++;
+    }
+
+    if (p == start || v == 0) {
+        return NULL;
+    }
+
+    *value = v;
+    return p;
+}
+
+// Parse a decimal dimension ending at the given terminator.
+// Returns a pointer past the terminator, or NULL if the number is invalid.
+static const char *parse_dimension(const char *p, char terminator, int *value) {
+    p = parse_number(p, value);
+    return p && *p == terminator ? p + 1 : NULL;
+}
+
+// Check if the len characters at p are the given option name
+static int option_is(const char *p, size_t len, const char *name) {
+    return strlen(name) == len && strncmp(p, name, len) == 0;
+}
+
+// Parse the comma-separated options following the size, up to the slash.
+// Returns a pointer past the slash, or NULL on an unknown or invalid option.
+static const char *parse_options(const char *p, image_request *req) {
+    for (;;) {
+        const char *end = p;
+        size_t len;
+
+        while (*end && *end != ',' && *end != '/') {
+            end++;
+        }
+        len = end - p;
+
+        if (len > 1 && *p == 'q') {
+            int quality;
+            if (parse_number(p + 1, &quality) != end || quality > 100) {
+                return NULL;
+            }
+            req->quality = quality;
+        } else if (option_is(p, len, "contain")) {
+            req->fit = IMAGE_FIT_CONTAIN;
+        } else if (option_is(p, len, "cover")) {
+            req->fit = IMAGE_FIT_COVER;
+        } else if (option_is(p, len, "cover-center")) {
+            req->fit = IMAGE_FIT_COVER_CENTER;
+        } else {
+            return NULL;
+        }
+
+        if (*end != ',') {
+            return *end == '/' ? end + 1 : NULL;
+        }
+        p = end + 1;
+    }
+}
+
+// Check that a path is at least "x.y" with the dot in its last component:
+// some characters, a dot, then at least one character and no slash
+static int valid_filename(const char *path) {
+    const char *p;
+    const char *dot = NULL;
+
+    for (p = path; *p; p++) {
+        if (*p == '/') {
+            dot = NULL;
+        } else if (*p == '.' && p > path && !dot) {
+            dot = p;
+        }
+    }
+
+    return dot && dot[1] != '\0';
+}
+
+image_format image_format_from_filename(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+
+    if (!ext) {
+        return IMAGE_FORMAT_UNKNOWN;
+    }
+
+    ext++; // Skip the dot
+    if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0)
+        return IMAGE_FORMAT_JPEG;
+    if (strcasecmp(ext, "png") == 0)
+        return IMAGE_FORMAT_PNG;
+    if (strcasecmp(ext, "gif") == 0)
+        return IMAGE_FORMAT_GIF;
+    if (strcasecmp(ext, "webp") == 0)
+        return IMAGE_FORMAT_WEBP;
+    if (strcasecmp(ext, "avif") == 0)
+        return IMAGE_FORMAT_AVIF;
+    return IMAGE_FORMAT_UNKNOWN;
+}
+
+int image_resize_parse_url(const char *url, image_request *req) {
+    const char *slash;
+
+    // Try each slash from the left, like the leftmost regex match did
+    for (slash = strchr(url, '/'); slash; slash = strchr(slash + 1, '/')) {
+        int width, height;
+        const char *p = parse_dimension(slash + 1, 'x', &width);
+
+        if (!p || !(p = parse_number(p, &height))) {
+            continue;
+        }
+
+        req->quality = 0;
+        req->fit = IMAGE_FIT_CONTAIN;
+        if (*p == ',') {
+            p = parse_options(p + 1, req);
+        } else {
+            p = *p == '/' ? p + 1 : NULL;
+        }
+        if (!p || !valid_filename(p)) {
+            continue;
+        }
+
+        req->filename = p;
+        req->width = width;
+        req->height = height;
+        req->format = image_format_from_filename(p);
+        return 0;
+    }
+
+    return -1;
+}
+
+const char *image_format_name(image_format format) {
+    switch (format) {
+    case IMAGE_FORMAT_JPEG: return "jpg";
+    case IMAGE_FORMAT_PNG:  return "png";
+    case IMAGE_FORMAT_GIF:  return "gif";
+    case IMAGE_FORMAT_WEBP: return "webp";
+    case IMAGE_FORMAT_AVIF: return "avif";
+    default:                return "unknown";
+    }
+}
+
+const char *image_fit_name(image_fit fit) {
+    switch (fit) {
+    case IMAGE_FIT_COVER:        return "cover";
+    case IMAGE_FIT_COVER_CENTER: return "cover-center";
+    default:                     return "contain";
+    }
+}
+
+char *image_resize_canonical_options(const image_request *req, int default_quality,
+                                     char *buf, size_t len) {
+    int n = 0;
+
+    buf[0] = '\0';
+    if (req->quality && req->quality != default_quality) {
+        n = snprintf(buf, len, ",q%d", req->quality);
+    }
+    if (req->fit != IMAGE_FIT_CONTAIN && n >= 0 && (size_t)n < len) {
+        snprintf(buf + n, len - n, ",%s", image_fit_name(req->fit));
+    }
+    return buf;
+}
+
+const char *image_format_content_type(image_format format) {
+    switch (format) {
+    case IMAGE_FORMAT_PNG:  return "image/png";
+    case IMAGE_FORMAT_GIF:  return "image/gif";
+    case IMAGE_FORMAT_WEBP: return "image/webp";
+    case IMAGE_FORMAT_AVIF: return "image/avif";
+    default:                return "image/jpeg"; // JPEG, and default
+    }
+}
+
+// Check if an Accept header lists a media type with a non-zero quality.
+// Wildcards are ignored: browsers send "*/*" whatever they can decode.
+static int accepts_media_type(const char *accept, const char *type) {
+    size_t type_len = strlen(type);
+    const char *p = accept;
+
+    while (*p) {
+        const char *range, *end;
+
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        range = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        end = p;
+
+        // Parameters of the media range: only q matters
+        int rejected = 0;
+        while (*p && *p != ',') {
+            if (*p == ';') {
+                p++;
+                while (*p == ' ' || *p == '\t') p++;
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+                    const char *q = p + 2;
+                    // q=0, q=0.0, q=0.00 or q=0.000
+                    if (*q == '0') {
+                        q++;
+                        if (*q == '.') {
+                            q++;
+                            while (*q == '0') q++;
+                        }
+                        rejected = !(*q >= '1' && *q <= '9');
+                    }
+                }
+                continue;
+            }
+            p++;
+        }
+
+        if ((size_t)(end - range) == type_len && strncasecmp(range, type, type_len) == 0) {
+            return !rejected;
+        }
+    }
+
+    return 0;
+}
+
+image_format image_resize_negotiate_format(const char *accept, image_format requested) {
+    if (!accept || (requested != IMAGE_FORMAT_JPEG && requested != IMAGE_FORMAT_PNG)) {
+        return requested;
+    }
+    if (accepts_media_type(accept, "image/avif")) {
+        return IMAGE_FORMAT_AVIF;
+    }
+    if (accepts_media_type(accept, "image/webp")) {
+        return IMAGE_FORMAT_WEBP;
+    }
+    return requested;
+}
@@ -0,0 +1,75 @@
+/**
+ * image_resize_url.h
+ *
+ * URL parsing for mod_image_resize. Kept free of Apache and APR
+ * dependencies so that it can be built into standalone tools.
+ */
+
+#ifndef IMAGE_RESIZE_URL_H
+#define IMAGE_RESIZE_URL_H
+
+#include <stddef.h>
+
+// Output image formats, from the extension of the requested file
+typedef enum {
+    IMAGE_FORMAT_UNKNOWN = 0,    // Unsupported extension, rendered as JPEG
+    IMAGE_FORMAT_JPEG,
+    IMAGE_FORMAT_PNG,
+    IMAGE_FORMAT_GIF,
+    IMAGE_FORMAT_WEBP,
+    IMAGE_FORMAT_AVIF
+} image_format;
+
+// How the image is fitted to the requested size
+typedef enum {
+    IMAGE_FIT_CONTAIN = 0,       // Fit inside WIDTHxHEIGHT, keeping the aspect ratio (default)
+    IMAGE_FIT_COVER,             // Fill WIDTHxHEIGHT, cropping the least interesting parts
+    IMAGE_FIT_COVER_CENTER       // Fill WIDTHxHEIGHT, cropping around the center
+} image_fit;
+
+// Request info structure
+typedef struct {
+    const char* filename;        // Image filename (including path), points into the URL
+    int width;                   // Target width
+    int height;                  // Target height
+    image_format format;         // Output format
+    int quality;                 // Quality option of the URL, 1-100 (0 = directory default)
+    image_fit fit;               // Fit option of the URL
+} image_request;
+
+// Parse a URL of the form .../WIDTHxHEIGHT[,option...]/path/to/filename.ext in
+// a single pass, without allocating. The options are "qN" (quality 1-100),
+// "contain", "cover" and "cover-center"; the last one of a kind wins.
+// Returns 0 on success, -1 if the URL does not match, if a dimension is zero
+// or does not fit in an int, or if an option is unknown or out of range.
+int image_resize_parse_url(const char *url, image_request *req);
+
+// Name of a fit mode, as written in URLs
+const char *image_fit_name(image_fit fit);
+
+// Size of a buffer holding the canonical options of any request
+#define IMAGE_RESIZE_OPTIONS_SIZE 32
+
+// Canonical options of a request for cache keys, such as ",q60,cover", in a
+// fixed order and without the options equal to their default, so that
+// equivalent URLs share one cache entry. Empty for a request without options.
+// Returns buf.
+char *image_resize_canonical_options(const image_request *req, int default_quality,
+                                     char *buf, size_t len);
+
+// Output format of a file, from its extension
+image_format image_format_from_filename(const char *filename);
+
+// Short name of a format: "jpg", "png", "gif", "webp", "avif" or "unknown"
+const char *image_format_name(image_format format);
+
+// Content-Type of an output format (unknown formats are rendered as JPEG)
+const char *image_format_content_type(image_format format);
+
+// Best output format for an Accept header: AVIF, then WebP when the client
+// accepts them with a non-zero quality, else the requested format. Only JPEG
+// and PNG outputs are negotiated; GIF keeps its animations and WebP and AVIF
+// are already served as asked.
+image_format image_resize_negotiate_format(const char *accept, image_format requested);
+
+#endif /* IMAGE_RESIZE_URL_H */
@@ -8,429 +8,953 @@
 
 #include "mod_image_resize.h"
 #include <vips/vips.h>
-#include <regex.h>
 #include <libimagequant.h>
 #include <png.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <apr_md5.h>
+#include <ap_mpm.h>
+#include <unistd.h>
 
-// Global mutex for cache operations
-static apr_thread_mutex_t *cache_mutex = NULL;
+// Number of lock stripes used by the in-flight render table
+#define INFLIGHT_STRIPES 64
 
-// Track libvips initialization in child processes
-static int libvips_initialized = 0;
+// A render in progress for one cache key, shared by the thread rendering it
+// and by the threads waiting for its result
+typedef struct inflight_render {
+    struct inflight_render *next; // Next render in the same stripe
+    int refcount;                 // Leader plus waiting threads
+    int done;                     // Set by the leader once the render is over
+    int status;                   // Result of image_resize_process_image() for waiters
+    char key[1];                  // Cache path (allocated with the entry)
+} inflight_render;
 
-// Function to parse URL and extract dimensions/filename
-static image_request* parse_url(request_rec *r, const char *url) {
-    regex_t regex;
-    regmatch_t matches[4];
-    image_request* req;
-    
-    DEBUG_LOG(r, "Parsing URL: %s", url);
+// One stripe of the in-flight render table
+typedef struct {
+    apr_thread_mutex_t *mutex;    // Protects the list below
+    apr_thread_cond_t *cond;      // Signalled when a render of this stripe ends
+    inflight_render *head;        // Renders in progress hashing to this stripe
+} inflight_stripe;
+
+// Per-child table of renders in progress, keyed on the cache path
+static inflight_stripe inflight_table[INFLIGHT_STRIPES];
+static int inflight_initialized = 0;
+
+// Create the stripe mutexes and condition variables of the in-flight table
+static apr_status_t inflight_init(apr_pool_t *p) {
+    apr_status_t rv;
+    int i;
     
-    // Format: /WIDTHxHEIGHT/path/to/filename.ext
-    int ret = regcomp(&regex, "/([0-9]+)x([0-9]+)/(.+\\.[^\\/]+)$", REG_EXTENDED);
-    if (ret) {
-        ERROR_LOG(r, "Error compiling regex");
-        return NULL;
+    for (i = 0; i < INFLIGHT_STRIPES; i++) {
+        rv = apr_thread_mutex_create(&inflight_table[i].mutex, APR_THREAD_MUTEX_DEFAULT, p);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        rv = apr_thread_cond_create(&inflight_table[i].cond, p);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        inflight_table[i].head = NULL;
     }
     
-    ret = regexec(&regex, url, 4, matches, 0);
-    if (ret != 0) {
-        WARNING_LOG(r, "URL does not match expected format");
-        regfree(&regex);
-        return NULL;
+    inflight_initialized = 1;
+    return APR_SUCCESS;
+}
+
+// Join the render of a cache key. Returns the in-flight entry and sets
+// *leader when the caller is the first one and must do the render itself.
+static inflight_render *inflight_join(const char *key, int *leader) {
+    inflight_stripe *stripe = &inflight_table[image_resize_hash_string(key) % INFLIGHT_STRIPES];
+    inflight_render *render;
+    size_t key_len = strlen(key);
+    
+    apr_thread_mutex_lock(stripe->mutex);
+    
+    for (render = stripe->head; render; render = render->next) {
+        if (strcmp(render->key, key) == 0) {
+            render->refcount++;
+            apr_thread_mutex_unlock(stripe->mutex);
+            *leader = 0;
+            return render;
+        }
     }
     
-    req = apr_pcalloc(r->pool, sizeof(image_request));
-    if (!req) {
-        ERROR_LOG(r, "Memory allocation error for request");
-        regfree(&regex);
+    // Entries outlive the request of the leader, so they use the heap
+    render = malloc(sizeof(inflight_render) + key_len);
+    if (!render) {
+        apr_thread_mutex_unlock(stripe->mutex);
+        *leader = 1;
         return NULL;
     }
-    
-    // Extract width
-    char width_str[10] = {0};
-    size_t width_len = matches[1].rm_eo - matches[1].rm_so;
-    if (width_len >= sizeof(width_str)) width_len = sizeof(width_str) - 1;
-    strncpy(width_str, url + matches[1].rm_so, width_len);
-    req->width = atoi(width_str);
-    
-    // Extract height
-    char height_str[10] = {0};
-    size_t height_len = matches[2].rm_eo - matches[2].rm_so;
-    if (height_len >= sizeof(height_str)) height_len = sizeof(height_str) - 1;
-    strncpy(height_str, url + matches[2].rm_so, height_len);
-    req->height = atoi(height_str);
-    
-    // Extract filename with path
-    req->filename = apr_pcalloc(r->pool, matches[3].rm_eo - matches[3].rm_so + 1);
-    if (!req->filename) {
-        ERROR_LOG(r, "Memory allocation error for filename");
-        regfree(&regex);
-        return NULL;
+    memcpy(render->key, key, key_len + 1);
+    render->refcount = 1;
+    render->done = 0;
+    render->status = -1;
+    render->next = stripe->head;
+    stripe->head = render;
+    
+    apr_thread_mutex_unlock(stripe->mutex);
+    *leader = 1;
+    return render;
+}
+
+// Drop a reference to an in-flight entry (stripe mutex must be held)
+static void inflight_release_locked(inflight_render *render) {
+    if (--render->refcount == 0) {
+        free(render);
     }
-    strncpy(req->filename, url + matches[3].rm_so, matches[3].rm_eo - matches[3].rm_so);
-    
-    // Extract format from extension
-    const char *ext = strrchr(req->filename, '.');
-    if (ext) {
-        ext++; // Skip the dot
-        if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0)
-            req->format = apr_pstrdup(r->pool, "jpg");
-        else if (strcasecmp(ext, "png") == 0)
-            req->format = apr_pstrdup(r->pool, "png");
-        else if (strcasecmp(ext, "gif") == 0)
-            req->format = apr_pstrdup(r->pool, "gif");
-        else if (strcasecmp(ext, "webp") == 0)
-            req->format = apr_pstrdup(r->pool, "webp");
-        else
-            req->format = apr_pstrdup(r->pool, "unknown");
-    } else {
-        req->format = apr_pstrdup(r->pool, "unknown");
+}
+
+// Publish the result of a render and wake up the threads waiting for it
+static void inflight_finish(inflight_render *render, int status) {
+    inflight_stripe *stripe = &inflight_table[image_resize_hash_string(render->key) % INFLIGHT_STRIPES];
+    inflight_render **link;
+    
+    apr_thread_mutex_lock(stripe->mutex);
+    
+    // Unlink so that later misses start a fresh render
+    for (link = &stripe->head; *link; link = &(*link)->next) {
+        if (*link == render) {
+            *link = render->next;
+            break;
+        }
     }
     
-    DEBUG_LOG(r, "Parsed request: filename=%s, dimensions=%dx%d, format=%s", 
-             req->filename, req->width, req->height, req->format);
+    render->done = 1;
+    render->status = status;
+    apr_thread_cond_broadcast(stripe->cond);
+    inflight_release_locked(render);
     
-    regfree(&regex);
-    return req;
+    apr_thread_mutex_unlock(stripe->mutex);
 }
 
-// Ensure a directory exists, creating it recursively if needed
-static apr_status_t ensure_directory_exists(apr_pool_t *pool, const char *dir) {
-    apr_status_t rv;
-    apr_finfo_t finfo;
+// Wait for the leader of a render to finish and return its status
+static int inflight_wait(inflight_render *render) {
+    inflight_stripe *stripe = &inflight_table[image_resize_hash_string(render->key) % INFLIGHT_STRIPES];
+    int status;
     
-    // Check if directory exists
-    rv = apr_stat(&finfo, dir, APR_FINFO_TYPE, pool);
-    if (rv == APR_SUCCESS) {
-        if (finfo.filetype == APR_DIR) {
-            return APR_SUCCESS;
-        }
-        return APR_ENOTDIR;
+    apr_thread_mutex_lock(stripe->mutex);
+    
+    // The stripe condition is shared by all keys of the stripe
+    while (!render->done) {
+        apr_thread_cond_wait(stripe->cond, stripe->mutex);
     }
+    status = render->status;
+    inflight_release_locked(render);
     
-    // Create directory recursively
-    rv = apr_dir_make_recursive(dir, APR_FPROT_UREAD | APR_FPROT_UWRITE | APR_FPROT_UEXECUTE |
-                                     APR_FPROT_GREAD | APR_FPROT_GEXECUTE |
-                                     APR_FPROT_WREAD | APR_FPROT_WEXECUTE, pool);
-    return rv;
+    apr_thread_mutex_unlock(stripe->mutex);
+    return status;
 }
 
-// Ensure parent directory of a file exists
-static int ensure_parent_directory_exists(request_rec *r, const char *file_path) {
-    char dir_path[512];
-    char *last_slash;
+// Number of slots of the per-child negative cache of missing sources
+#define NEGATIVE_CACHE_SLOTS 4096
+
+// A source recently found missing
+typedef struct {
+    apr_uint64_t hash;            // Hash of the source path, 0 if the slot is free
+    apr_time_t expires;           // When the entry stops being trusted
+} negative_cache_slot;
+
+// Per-child direct-mapped table of missing sources, checked before any filesystem access
+static negative_cache_slot negative_cache[NEGATIVE_CACHE_SLOTS];
+static apr_thread_mutex_t *negative_cache_mutex = NULL;
+
+// Check if a source was found missing less than its TTL ago
+static int negative_cache_lookup(const char *source_path) {
+    apr_uint64_t hash = image_resize_hash64_string(source_path) | 1;
+    negative_cache_slot *slot = &negative_cache[hash % NEGATIVE_CACHE_SLOTS];
+    int found;
+    
+    if (!negative_cache_mutex) {
+        return 0;
+    }
     
-    // Copy file path
-    strncpy(dir_path, file_path, sizeof(dir_path) - 1);
-    dir_path[sizeof(dir_path) - 1] = '\0';
+    apr_thread_mutex_lock(negative_cache_mutex);
+    found = slot->hash == hash && slot->expires > apr_time_now();
+    apr_thread_mutex_unlock(negative_cache_mutex);
+    
+    return found;
+}
+
+// Remember a missing source for ttl seconds, replacing whatever used its slot
+static void negative_cache_insert(const char *source_path, int ttl) {
+    apr_uint64_t hash = image_resize_hash64_string(source_path) | 1;
+    negative_cache_slot *slot = &negative_cache[hash % NEGATIVE_CACHE_SLOTS];
     
-    // Find last slash to get parent directory
-    last_slash = strrchr(dir_path, '/');
-    if (!last_slash) {
-        return 0; // No slash, no directory to create
+    if (!negative_cache_mutex) {
+        return;
     }
     
-    // Terminate string at last slash to get just the directory path
-    *last_slash = '\0';
+    apr_thread_mutex_lock(negative_cache_mutex);
+    slot->hash = hash;
+    slot->expires = apr_time_now() + apr_time_from_sec(ttl);
+    apr_thread_mutex_unlock(negative_cache_mutex);
+}
+
+// Number of slots of the per-child cache of source modification times
+#define MTIME_CACHE_SLOTS 4096
+
+// A source modification time, as seen by a recent stat
+typedef struct {
+    apr_uint64_t hash;            // Hash of the source path, 0 if the slot is free
+    apr_time_t mtime;             // Modification time of the source
+    apr_time_t expires;           // When the source must be stat'ed again
+} mtime_cache_slot;
+
+// Per-child direct-mapped table of source modification times, so that
+// ImageResizeCheckMTime does not stat the source on every cache hit
+static mtime_cache_slot mtime_cache[MTIME_CACHE_SLOTS];
+static apr_thread_mutex_t *mtime_cache_mutex = NULL;
+
+// Get the modification time of a source, stat'ing it at most once every ttl
+// seconds per child. Failed stats are not cached.
+static apr_status_t source_mtime(apr_pool_t *p, const image_resize_config *cfg,
+                                 const char *source_path, apr_time_t *mtime) {
+    apr_uint64_t hash = 0;
+    mtime_cache_slot *slot = NULL;
+    apr_finfo_t source_finfo;
+    apr_status_t rv;
     
-    // Check if directory already exists
-    apr_finfo_t finfo;
-    if (apr_stat(&finfo, dir_path, APR_FINFO_TYPE, r->pool) == APR_SUCCESS) {
-        if (finfo.filetype == APR_DIR) {
-            return 0; // Directory already exists
+    if (cfg->mtime_ttl > 0 && mtime_cache_mutex) {
+        hash = image_resize_hash64_string(source_path) | 1;
+        slot = &mtime_cache[hash % MTIME_CACHE_SLOTS];
+        
+        apr_thread_mutex_lock(mtime_cache_mutex);
+        if (slot->hash == hash && slot->expires > apr_time_now()) {
+            *mtime = slot->mtime;
+            apr_thread_mutex_unlock(mtime_cache_mutex);
+            return APR_SUCCESS;
         }
-        ERROR_LOG(r, "Path exists but is not a directory: %s", dir_path);
-        return -1;
+        apr_thread_mutex_unlock(mtime_cache_mutex);
+    }
+    
+    if ((rv = apr_stat(&source_finfo, source_path, APR_FINFO_MTIME, p)) != APR_SUCCESS) {
+        return rv;
+    }
+    *mtime = source_finfo.mtime;
+    
+    if (slot) {
+        apr_thread_mutex_lock(mtime_cache_mutex);
+        slot->hash = hash;
+        slot->mtime = source_finfo.mtime;
+        slot->expires = apr_time_now() + apr_time_from_sec(cfg->mtime_ttl);
+        apr_thread_mutex_unlock(mtime_cache_mutex);
     }
     
-    DEBUG_LOG(r, "Creating parent directory recursively: %s", dir_path);
+    return APR_SUCCESS;
+}
+
+// Per-child admission control of the renders of request threads
+typedef struct {
+    apr_thread_mutex_t *mutex;    // Protects the counters below
+    apr_thread_cond_t *cond;      // Signaled when a render slot is released
+    int max_renders;              // Renders allowed at once, 0 when admission control is off
+    int max_queued;               // Requests allowed to wait for a slot
+    apr_interval_time_t timeout;  // Longest wait for a slot
+    int running;                  // Renders in progress
+    int queued;                   // Requests waiting for a slot
+} render_admission;
+
+static render_admission admission = { NULL, NULL, 0, 0, 0, 0, 0 };
+
+static apr_status_t render_admission_init(apr_pool_t *p, const image_resize_server_config *scfg) {
+    apr_status_t rv;
     
-    // Create directory recursively
-    apr_status_t rv = apr_dir_make_recursive(dir_path, 
-                                           APR_FPROT_UREAD | APR_FPROT_UWRITE | APR_FPROT_UEXECUTE |
-                                           APR_FPROT_GREAD | APR_FPROT_GEXECUTE |
-                                           APR_FPROT_WREAD | APR_FPROT_WEXECUTE, 
-                                           r->pool);
+    if (scfg->max_renders <= 0) {
+        return APR_SUCCESS;
+    }
+    if ((rv = apr_thread_mutex_create(&admission.mutex, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS ||
+        (rv = apr_thread_cond_create(&admission.cond, p)) != APR_SUCCESS) {
+        return rv;
+    }
+    admission.max_queued = scfg->render_queue;
+    admission.timeout = apr_time_from_sec(scfg->render_queue_timeout);
+    admission.max_renders = scfg->max_renders;
+    return APR_SUCCESS;
+}
+
+// Take a render slot, waiting in the queue if all are in use. Returns 0, or
+// IMAGE_BUSY when the queue is full or the wait timed out. Background renders
+// have their own threads and are not counted.
+static int render_admit(const image_render_ctx *ctx) {
+    apr_time_t start, deadline;
+    int status = 0;
+    
+    if (!admission.max_renders || ctx->background) {
+        return 0;
+    }
     
-    if (rv != APR_SUCCESS) {
-        ERROR_LOG(r, "Failed to create parent directory: %s (code: %d)", 
-                 dir_path, rv);
-        return -1;
+    apr_thread_mutex_lock(admission.mutex);
+    if (admission.running >= admission.max_renders) {
+        if (admission.queued >= admission.max_queued) {
+            apr_thread_mutex_unlock(admission.mutex);
+            RENDER_WARNING_LOG(ctx, "Render queue full (%d waiting), rejecting render", admission.queued);
+            return IMAGE_BUSY;
+        }
+        
+        RENDER_DEBUG_LOG(ctx, "All %d render slots in use, waiting", admission.max_renders);
+        if (ctx->timings) {
+            ctx->timings->lock_waits++;
+        }
+        start = image_resize_clock();
+        deadline = apr_time_now() + admission.timeout;
+        admission.queued++;
+        while (admission.running >= admission.max_renders) {
+            apr_interval_time_t remaining = deadline - apr_time_now();
+            if (remaining <= 0) {
+                status = IMAGE_BUSY;
+                break;
+            }
+            apr_thread_cond_timedwait(admission.cond, admission.mutex, remaining);
+        }
+        admission.queued--;
+        image_render_phase_end(ctx, IMAGE_PHASE_LOCK, start);
     }
+    if (status == 0) {
+        admission.running++;
+    }
+    apr_thread_mutex_unlock(admission.mutex);
     
-    // Ensure permissions are correct for Apache
-    if (chown(dir_path, geteuid(), getegid()) != 0) {
-        WARNING_LOG(r, "Unable to change directory owner: %s", 
-                 dir_path);
+    if (status != 0) {
+        RENDER_WARNING_LOG(ctx, "No render slot freed in time, rejecting render");
+    }
+    return status;
+}
+
+// Release a slot taken by render_admit()
+static void render_release(const image_render_ctx *ctx) {
+    if (!admission.max_renders || ctx->background) {
+        return;
     }
     
-    return 0;
+    apr_thread_mutex_lock(admission.mutex);
+    admission.running--;
+    apr_thread_cond_signal(admission.cond);
+    apr_thread_mutex_unlock(admission.mutex);
 }
 
-// Process an image with libvips - resize and compress according to format
-static int process_image(request_rec *r, const image_resize_config *cfg, 
-                       const image_request *req, const char *output_path) {
-    char input_path[512];
-    int ret = -1;
-    VipsImage *in = NULL, *out = NULL;
+// Take up to wanted more slots for the extra threads of a render holding one,
+// without waiting for them. Returns the number taken, all of them when admission
+// control is off. Background renders get none, their threads being counted by
+// their own pools.
+static int render_admit_extra(const image_render_ctx *ctx, int wanted) {
+    int taken;
+    
+    if (ctx->background) {
+        return 0;
+    }
+    if (!admission.max_renders) {
+        return wanted;
+    }
     
-    // Check if libvips is initialized
-    if (!libvips_initialized) {
-        ERROR_LOG(r, "LibVips not initialized, cannot process image");
-        return -1;
+    apr_thread_mutex_lock(admission.mutex);
+    taken = admission.max_renders - admission.running;
+    taken = taken < wanted ? taken : wanted;
+    taken = taken > 0 ? taken : 0;
+    admission.running += taken;
+    apr_thread_mutex_unlock(admission.mutex);
+    
+    return taken;
+}
+
+// Release the slots taken by render_admit_extra()
+static void render_release_extra(const image_render_ctx *ctx, int taken) {
+    if (!admission.max_renders || ctx->background || taken <= 0) {
+        return;
     }
     
-    // Build path to source image
-    apr_snprintf(input_path, sizeof(input_path), "%s/%s", cfg->image_dir, req->filename);
-    DEBUG_LOG(r, "Source image path: %s", input_path);
+    apr_thread_mutex_lock(admission.mutex);
+    admission.running -= taken;
+    apr_thread_cond_broadcast(admission.cond);
+    apr_thread_mutex_unlock(admission.mutex);
+}
+
+// Size of the cross-process registry of renders in progress
+#define RENDER_REGISTRY_SLOTS 1024
+#define RENDER_REGISTRY_PROBES 8
+#define RENDER_REGISTRY_KEY_LEN 256
+
+// Delay between two checks of a render owned by another process
+#define RENDER_REGISTRY_POLL_INTERVAL apr_time_from_msec(25)
+
+// Mutex type protecting the registry, configurable with the Mutex directive
+static const char *render_registry_mutex_type = "image-resize-render";
+
+// A render in progress somewhere in the server, stored in shared memory
+typedef struct {
+    apr_uint32_t hash;            // Hash of the cache path, 0 if the slot is free
+    apr_pid_t owner;              // Process doing the render
+    apr_time_t started;           // When the render was claimed
+    char key[RENDER_REGISTRY_KEY_LEN]; // Cache path (truncated if longer)
+} render_registry_slot;
+
+// Result of a claim in the cross-process registry
+typedef enum {
+    REGISTRY_CLAIMED,             // Caller owns the render
+    REGISTRY_BUSY,                // Another process owns the render
+    REGISTRY_UNAVAILABLE          // No registry or no free slot, render without it
+} render_registry_claim;
+
+// Shared registry, created before the children are forked
+static apr_shm_t *render_registry_shm = NULL;
+static render_registry_slot *render_registry = NULL;
+static apr_global_mutex_t *render_registry_mutex = NULL;
+
+// Check if a registry slot holds the given key
+static int render_registry_match(const render_registry_slot *slot, apr_uint32_t hash, const char *key) {
+    return slot->hash == hash && strncmp(slot->key, key, RENDER_REGISTRY_KEY_LEN - 1) == 0;
+}
+
+// Check if the owner of a slot has given up on its render (crashed or timed out)
+static int render_registry_abandoned(const render_registry_slot *slot, apr_interval_time_t timeout) {
+    if (kill(slot->owner, 0) != 0 && errno == ESRCH) {
+        return 1;
+    }
+    return apr_time_now() - slot->started > timeout;
+}
+
+// Try to become the only process of the server rendering a cache key
+static render_registry_claim render_registry_try_claim(const char *key, apr_uint32_t hash,
+                                                       apr_interval_time_t timeout) {
+    render_registry_slot *free_slot = NULL;
+    render_registry_claim result = REGISTRY_UNAVAILABLE;
+    int i;
+    
+    if (apr_global_mutex_lock(render_registry_mutex) != APR_SUCCESS) {
+        return REGISTRY_UNAVAILABLE;
+    }
     
-    // Check if source image exists
-    apr_finfo_t finfo;
-    if (apr_stat(&finfo, input_path, APR_FINFO_TYPE, r->pool) != APR_SUCCESS) {
-        WARNING_LOG(r, "Source image not found: %s", input_path);
-        return -2; // Special return code for image not found
+    // Slots are freed in place, so the whole probe window is always scanned
+    for (i = 0; i < RENDER_REGISTRY_PROBES; i++) {
+        render_registry_slot *slot = &render_registry[(hash + i) % RENDER_REGISTRY_SLOTS];
+        if (slot->hash == 0) {
+            if (!free_slot) free_slot = slot;
+        } else if (render_registry_match(slot, hash, key)) {
+            if (!render_registry_abandoned(slot, timeout)) {
+                result = REGISTRY_BUSY;
+                goto unlock;
+            }
+            // Take over the render of a dead or stuck owner
+            free_slot = slot;
+            break;
+        }
     }
     
-    DEBUG_LOG(r, "Output path: %s", output_path);
+    if (free_slot) {
+        free_slot->hash = hash;
+        free_slot->owner = getpid();
+        free_slot->started = apr_time_now();
+        apr_cpystrn(free_slot->key, key, RENDER_REGISTRY_KEY_LEN);
+        result = REGISTRY_CLAIMED;
+    }
     
-    // Ensure parent directory exists before processing
-    if (ensure_parent_directory_exists(r, output_path) != 0) {
-        ERROR_LOG(r, "Failed to create parent directory for cache file");
-        return -1;
+unlock:
+    apr_global_mutex_unlock(render_registry_mutex);
+    return result;
+}
+
+// Claim the render of a cache key, waiting up to timeout while another process
+// owns it. Returns REGISTRY_CLAIMED when the caller must render and release.
+static render_registry_claim render_registry_claim_key(const image_render_ctx *ctx, const char *key,
+                                                       apr_interval_time_t timeout) {
+    apr_uint32_t hash = image_resize_hash_string(key) | 1; // 0 marks free slots
+    apr_time_t deadline = apr_time_now() + timeout;
+    render_registry_claim result;
+    int waited = 0;
+    
+    if (!render_registry) {
+        return REGISTRY_UNAVAILABLE;
     }
     
-    // Load the image
-    if (!(in = vips_image_new_from_file(input_path, NULL))) {
-        ERROR_LOG(r, "Failed to load image: %s", vips_error_buffer());
-        vips_error_clear();
-        return -1;
+    while ((result = render_registry_try_claim(key, hash, timeout)) == REGISTRY_BUSY) {
+        if (!waited && ctx->timings) {
+            ctx->timings->lock_waits++;
+        }
+        waited = 1;
+        if (apr_time_now() >= deadline) {
+            RENDER_WARNING_LOG(ctx, "Timed out waiting for another process rendering %s", key);
+            return REGISTRY_UNAVAILABLE;
+        }
+        apr_sleep(RENDER_REGISTRY_POLL_INTERVAL);
     }
     
-    INFO_LOG(r, "Image loaded, original size: %dx%d", 
-             vips_image_get_width(in), vips_image_get_height(in));
+    return result;
+}
+
+// Release a render claimed with render_registry_claim_key()
+static void render_registry_release(const char *key) {
+    apr_uint32_t hash = image_resize_hash_string(key) | 1;
+    apr_pid_t self = getpid();
+    int i;
+    
+    if (apr_global_mutex_lock(render_registry_mutex) != APR_SUCCESS) {
+        return;
+    }
     
-    // Calculate scale factors preserving aspect ratio
-    double scale_x = (double)req->width / vips_image_get_width(in);
-    double scale_y = (double)req->height / vips_image_get_height(in);
-    double scale = scale_x < scale_y ? scale_x : scale_y;
+    for (i = 0; i < RENDER_REGISTRY_PROBES; i++) {
+        render_registry_slot *slot = &render_registry[(hash + i) % RENDER_REGISTRY_SLOTS];
+        if (render_registry_match(slot, hash, key) && slot->owner == self) {
+            slot->hash = 0;
+            slot->owner = 0;
+            break;
+        }
+    }
     
-    DEBUG_LOG(r, "Scaling factor: %f", scale);
+    apr_global_mutex_unlock(render_registry_mutex);
+}
+
+// Log sink of renders done for a request
+static void request_render_log(const image_render_ctx *ctx, int level, const char *msg) {
+    ap_log_rerror(APLOG_MARK, level, 0, (request_rec *)ctx->log_data, "[image_resize] %s", msg);
+}
+
+// Render context of a request: request pool, request log and its log level
+static void request_render_ctx(request_rec *r, image_render_ctx *ctx) {
+    ctx->pool = r->pool;
+    ctx->log = request_render_log;
+    ctx->log_data = r;
+    ctx->background = 0;
+    ctx->timings = image_resize_stats_timings(r);
+    ctx->log_level = RENDER_LOG_DEBUG;
+    while (ctx->log_level > RENDER_LOG_ERR && !APLOG_R_IS_LEVEL(r, ctx->log_level)) {
+        ctx->log_level--;
+    }
+}
+
+// Function to parse URL and extract dimensions/filename
+static int parse_url(request_rec *r, const char *url, image_request *req) {
+    DEBUG_LOG(r, "Parsing URL: %s", url);
     
-    // Resize the image
-    if (vips_resize(in, &out, scale, NULL)) {
-        ERROR_LOG(r, "Resize failed: %s", vips_error_buffer());
-        vips_error_clear();
-        g_object_unref(in);
+    // Format: /WIDTHxHEIGHT/path/to/filename.ext
+    if (image_resize_parse_url(url, req) != 0) {
+        WARNING_LOG(r, "URL does not match expected format");
         return -1;
     }
     
-    INFO_LOG(r, "Image resized to: %dx%d", 
-             vips_image_get_width(out), vips_image_get_height(out));
-    
-    // Save according to format with appropriate compression
-    if (strcmp(req->format, "jpg") == 0) {
-        // JPEG saving with mozjpeg (if available)
-        if (vips_jpegsave(out, output_path, 
-                         "Q", cfg->quality, // Use unified quality setting
-                         "optimize_coding", TRUE,
-                         "interlace", TRUE,
-                         NULL)) {
-            ERROR_LOG(r, "JPEG save failed: %s", vips_error_buffer());
-            vips_error_clear();
-            g_object_unref(in);
-            g_object_unref(out);
-            return -1;
-        }
-        ret = 0;
-    }
-    else if (strcmp(req->format, "png") == 0) {
-        // PNG saving with integrated libimagequant optimization
-        if (vips_pngsave(out, output_path, 
-                        "palette", TRUE,           // Use color palette
-                        "Q", cfg->quality,         // Use unified quality setting
-                        "compression", 9,          // Maximum compression
-                        "interlace", TRUE,         // Progressive loading
-                        NULL)) {
-            ERROR_LOG(r, "PNG save failed: %s", vips_error_buffer());
-            vips_error_clear();
-            g_object_unref(in);
-            g_object_unref(out);
-            return -1;
-        }
-        ret = 0;
-    }
-    else if (strcmp(req->format, "webp") == 0) {
-        // WebP saving with unified quality
-        if (vips_webpsave(out, output_path, "Q", cfg->quality, NULL)) {
-            ERROR_LOG(r, "WebP save failed: %s", vips_error_buffer());
-            vips_error_clear();
-            g_object_unref(in);
-            g_object_unref(out);
-            return -1;
-        }
-        ret = 0;
-    }
-    else if (strcmp(req->format, "gif") == 0) {
-        if (vips_gifsave(out, output_path, 
-                        "interlace", TRUE,
-                         NULL)) {
-            ERROR_LOG(r, "GIF save failed: %s", vips_error_buffer());
-            vips_error_clear();
-            g_object_unref(in);
-            g_object_unref(out);
-            return -1;
-        }
-        ret = 0;
-    }
-    else {
-        WARNING_LOG(r, "Unsupported format: %s, defaulting to JPEG", req->format);
-        // Default to JPEG
-        if (vips_jpegsave(out, output_path, "Q", cfg->quality, NULL)) {
-            ERROR_LOG(r, "Default JPEG save failed: %s", vips_error_buffer());
-            vips_error_clear();
-            g_object_unref(in);
-            g_object_unref(out);
-            return -1;
-        }
-        ret = 0;
-    }
-    
-    // Clean up
-    g_object_unref(in);
-    g_object_unref(out);
-    
-    // Check output file size
-    if (apr_stat(&finfo, output_path, APR_FINFO_SIZE, r->pool) == APR_SUCCESS) {
-        INFO_LOG(r, "Output file size: %" APR_OFF_T_FMT " bytes", finfo.size);
-    } else {
-        WARNING_LOG(r, "Unable to get output file size");
+    DEBUG_LOG(r, "Parsed request: filename=%s, dimensions=%dx%d, format=%s, quality=%d, fit=%s", 
+             req->filename, req->width, req->height, image_format_name(req->format),
+             req->quality, image_fit_name(req->fit));
+    
+    return 0;
+}
+
+// Release the render locks taken for a cache key and publish the render status
+static void render_done(inflight_render *render, render_registry_claim claim,
+                        const char *cache_path, int status) {
+    if (claim == REGISTRY_CLAIMED) {
+        render_registry_release(cache_path);
+    }
+    if (render) {
+        inflight_finish(render, status);
+    }
+}
+
+// Path of the cached variant of a request, preserving the subdirectory structure.
+// A negotiated format is appended to the name, so each format has its own entry,
+// and the canonical URL options to the size, so equivalent URLs share one entry.
+// In the hashed layout, the name is the MD5 of everything the render depends on,
+// and its first two bytes select two levels of 256 directories each.
+const char *image_resize_cache_path(apr_pool_t *p, const image_resize_config *cfg,
+                                    const image_request *req) {
+    char options[IMAGE_RESIZE_OPTIONS_SIZE];
+    
+    if (cfg->cache_layout == IMAGE_CACHE_LAYOUT_HASHED) {
+        static const char hex_digits[] = "0123456789abcdef";
+        unsigned char digest[APR_MD5_DIGESTSIZE];
+        char hex[2 * APR_MD5_DIGESTSIZE + 1];
+        const char *key = apr_psprintf(p, "%s/%s\n%dx%d\n%s\n%d%s", cfg->image_dir, req->filename,
+                                       req->width, req->height,
+                                       image_format_name(req->format), image_request_quality(req, cfg),
+                                       req->fit != IMAGE_FIT_CONTAIN ? image_fit_name(req->fit) : "");
+        int i;
+        
+        apr_md5(digest, key, strlen(key));
+        for (i = 0; i < APR_MD5_DIGESTSIZE; i++) {
+            hex[2 * i] = hex_digits[digest[i] >> 4];
+            hex[2 * i + 1] = hex_digits[digest[i] & 0x0f];
+        }
+        hex[2 * APR_MD5_DIGESTSIZE] = '\0';
+        
+        return apr_psprintf(p, "%s/%.2s/%.2s/%s.%s", cfg->cache_dir, hex, hex + 2, hex,
+                            image_format_name(req->format));
     }
     
-    return ret;
+    image_resize_canonical_options(req, cfg->quality, options, sizeof(options));
+    if (req->format != image_format_from_filename(req->filename)) {
+        return apr_psprintf(p, "%s/%dx%d%s_%s.%s", cfg->cache_dir, req->width, req->height, options,
+                            req->filename, image_format_name(req->format));
+    }
+    return apr_psprintf(p, "%s/%dx%d%s_%s", cfg->cache_dir, req->width, req->height, options,
+                        req->filename);
+}
+
+// Account for an image found in the disk cache
+static void render_cache_hit(const image_render_ctx *ctx, const char *cache_path, apr_time_t start) {
+    image_resize_janitor_record(cache_path, 1);
+    image_render_phase_end(ctx, IMAGE_PHASE_CACHE, start);
+    if (ctx->timings) {
+        ctx->timings->cache_result = "disk";
+    }
 }
 
 // Handle cache checking, directory creation, and mutex locking
-static int process_image_with_cache(request_rec *r, const image_resize_config *cfg, 
-                                  const image_request *req, char *cache_path, size_t path_size) {
+int image_resize_render_cached(const image_render_ctx *ctx, const image_resize_config *cfg, 
+                               const image_request *req, const char *cache_path,
+                               image_buffer *rendered) {
     int status = -1;
     
-    // Build cache path preserving subdirectory structure
-    apr_snprintf(cache_path, path_size, "%s/%dx%d_%s", 
-                cfg->cache_dir, req->width, req->height, req->filename);
+    RENDER_DEBUG_LOG(ctx, "Cache check/write: %s", cache_path);
     
-    DEBUG_LOG(r, "Cache check/write: %s", cache_path);
+    // Build path to source image
+    const char *source_path = apr_pstrcat(ctx->pool, cfg->image_dir, "/", req->filename, NULL);
+    apr_time_t start = image_resize_clock();
     
     // Check if image exists in cache (no mutex needed for reading)
     apr_finfo_t finfo;
-    if (apr_stat(&finfo, cache_path, APR_FINFO_SIZE | APR_FINFO_MTIME, r->pool) == APR_SUCCESS) {
+    if (apr_stat(&finfo, cache_path, APR_FINFO_SIZE | APR_FINFO_MTIME, ctx->pool) == APR_SUCCESS) {
         // Image already exists in cache
         
         // Check if we need to validate the source modification time
         if (cfg->check_source_mtime) {
-            char source_path[512];
-            apr_finfo_t source_finfo;
+            apr_time_t mtime;
             
-            // Build path to source image
-            apr_snprintf(source_path, sizeof(source_path), "%s/%s", cfg->image_dir, req->filename);
-            
-            // Get source file info
-            if (apr_stat(&source_finfo, source_path, APR_FINFO_MTIME, r->pool) == APR_SUCCESS) {
+            // Get source modification time
+            if (source_mtime(ctx->pool, cfg, source_path, &mtime) == APR_SUCCESS) {
                 // Compare modification times
-                if (source_finfo.mtime > finfo.mtime) {
-                    INFO_LOG(r, "Source image is newer than cached image, regenerating");
+                if (mtime > finfo.mtime) {
+                    RENDER_INFO_LOG(ctx, "Source image is newer than cached image, regenerating");
                     // Continue to processing - don't return here
                 } else {
-                    INFO_LOG(r, "Image found in cache and is up-to-date");
+                    RENDER_INFO_LOG(ctx, "Image found in cache and is up-to-date");
+                    render_cache_hit(ctx, cache_path, start);
                     return 0; // Success - cache is valid
                 }
             } else {
-                WARNING_LOG(r, "Unable to stat source image, using cached version");
+                RENDER_WARNING_LOG(ctx, "Unable to stat source image, using cached version");
+                render_cache_hit(ctx, cache_path, start);
                 return 0; // Success - use cached version
             }
         } else {
             // No mtime check needed
-            INFO_LOG(r, "Image found in cache");
+            RENDER_INFO_LOG(ctx, "Image found in cache");
+            render_cache_hit(ctx, cache_path, start);
             return 0; // Success
         }
     } else {
         // Image not in cache
-        DEBUG_LOG(r, "Image not found in cache, processing...");
+        RENDER_DEBUG_LOG(ctx, "Image not found in cache, processing...");
+    }
+    image_resize_janitor_record(cache_path, 0);
+    image_render_phase_end(ctx, IMAGE_PHASE_CACHE, start);
+    
+    // Check the source before creating anything in the cache directory, so that
+    // requests for missing images leave no empty directories behind. The cache
+    // directories are created by image_resize_process_image() once the source is known.
+    apr_finfo_t source_finfo;
+    if (apr_stat(&source_finfo, source_path, APR_FINFO_TYPE, ctx->pool) != APR_SUCCESS) {
+        RENDER_WARNING_LOG(ctx, "Source image not found: %s", source_path);
+        return IMAGE_NOT_FOUND;
     }
     
-    // Ensure cache base directory exists
-    if (ensure_directory_exists(r->pool, cfg->cache_dir) != APR_SUCCESS) {
-        ERROR_LOG(r, "Failed to create cache directory: %s", cfg->cache_dir);
-        return -1;
+    // Only one thread renders a given cache key, the others wait for its result
+    inflight_render *render = NULL;
+    start = image_resize_clock();
+    if (cfg->enable_mutex && inflight_initialized) {
+        int leader;
+        render = inflight_join(cache_path, &leader);
+        if (!leader) {
+            RENDER_DEBUG_LOG(ctx, "Waiting for another thread rendering %s", cache_path);
+            status = inflight_wait(render);
+            image_render_phase_end(ctx, IMAGE_PHASE_LOCK, start);
+            if (ctx->timings) {
+                ctx->timings->lock_waits++;
+                ctx->timings->cache_result = "wait";
+            }
+            if (status == 0) {
+                RENDER_INFO_LOG(ctx, "Image created by another thread while waiting for it");
+            }
+            return status;
+        }
     }
     
-    // Lock mutex only for cache write operations, if enabled
-    if (cfg->enable_mutex && cache_mutex) {
-        DEBUG_LOG(r, "Locking cache mutex for write operation");
-        apr_thread_mutex_lock(cache_mutex);
+    // Only one process of the server renders a given cache key, the others
+    // wait for it (up to the render timeout) and then find it in the cache
+    render_registry_claim claim = REGISTRY_UNAVAILABLE;
+    if (cfg->enable_mutex) {
+        claim = render_registry_claim_key(ctx, cache_path,
+                                          apr_time_from_sec(cfg->render_timeout));
+    }
+    image_render_phase_end(ctx, IMAGE_PHASE_LOCK, start);
+    if (ctx->timings) {
+        ctx->timings->cache_result = "wait";
     }
     
-    // Double-check if image exists in cache after locking (another thread might have created it)
-    if (cfg->enable_mutex && apr_stat(&finfo, cache_path, APR_FINFO_SIZE | APR_FINFO_MTIME, r->pool) == APR_SUCCESS) {
+    // Double-check if image exists in cache (another thread or process might have
+    // created it between our first check and our render registration)
+    if ((render || claim != REGISTRY_UNAVAILABLE) && apr_stat(&finfo, cache_path, APR_FINFO_SIZE | APR_FINFO_MTIME, ctx->pool) == APR_SUCCESS) {
         // Check if we need to validate source modification time, even for image created by another thread
         if (cfg->check_source_mtime) {
-            char source_path[512];
-            apr_finfo_t source_finfo;
-            
-            // Build path to source image
-            apr_snprintf(source_path, sizeof(source_path), "%s/%s", cfg->image_dir, req->filename);
+            apr_time_t mtime;
             
-            // Get source file info
-            if (apr_stat(&source_finfo, source_path, APR_FINFO_MTIME, r->pool) == APR_SUCCESS) {
+            // Get source modification time
+            if (source_mtime(ctx->pool, cfg, source_path, &mtime) == APR_SUCCESS) {
                 // Compare modification times
-                if (source_finfo.mtime > finfo.mtime) {
-                    INFO_LOG(r, "Source image is newer than image created by another thread, regenerating");
+                if (mtime > finfo.mtime) {
+                    RENDER_INFO_LOG(ctx, "Source image is newer than image created by another thread, regenerating");
                     // Continue to processing - don't return here
                 } else {
-                    INFO_LOG(r, "Image created by another thread is up-to-date");
-                    if (cfg->enable_mutex && cache_mutex) {
-                        apr_thread_mutex_unlock(cache_mutex);
-                    }
+                    RENDER_INFO_LOG(ctx, "Image created by another thread is up-to-date");
+                    render_done(render, claim, cache_path, 0);
                     return 0; // Success - cache is valid
                 }
             } else {
-                WARNING_LOG(r, "Unable to stat source image, using cached version from another thread");
-                if (cfg->enable_mutex && cache_mutex) {
-                    apr_thread_mutex_unlock(cache_mutex);
-                }
+                RENDER_WARNING_LOG(ctx, "Unable to stat source image, using cached version from another thread");
+                render_done(render, claim, cache_path, 0);
                 return 0; // Success - use cached version
             }
         } else {
             // No mtime check needed
-            INFO_LOG(r, "Image created by another thread while waiting for lock");
-            if (cfg->enable_mutex && cache_mutex) {
-                apr_thread_mutex_unlock(cache_mutex);
-            }
+            RENDER_INFO_LOG(ctx, "Image created by another thread before our render started");
+            render_done(render, claim, cache_path, 0);
             return 0; // Success
         }
     }
     
-    // Process the image
-    status = process_image(r, cfg, req, cache_path);
+    // Process the image, keeping the encoded bytes for the memory cache or the caller
+    image_buffer buffer = { NULL, 0, 0 };
+    int keep_buffer = rendered || image_resize_memcache_max_size(cache_path) > 0;
+    if (ctx->timings) {
+        ctx->timings->cache_result = "render";
+    }
+    if ((status = render_admit(ctx)) == 0) {
+        if (cfg->two_tier && !ctx->background) {
+            // Two-tier mode: the request gets a fast encode, and the entry is
+            // encoded again at full effort in the background
+            status = image_resize_process_image(ctx, cfg, req, cache_path, IMAGE_RENDER_FAST_ENCODE,
+                                                keep_buffer ? &buffer : NULL);
+            if (status == 0) {
+                image_resize_reencode_enqueue(cfg, req, cache_path);
+            }
+        } else {
+            status = image_resize_process_image(ctx, cfg, req, cache_path, 0,
+                                                keep_buffer ? &buffer : NULL);
+        }
+        render_release(ctx);
+    }
     
-    // Unlock mutex if it was locked
-    if (cfg->enable_mutex && cache_mutex) {
-        DEBUG_LOG(r, "Unlocking cache mutex");
-        apr_thread_mutex_unlock(cache_mutex);
+    if (status == 0 && buffer.data) {
+        image_resize_memcache_store(cache_path, buffer.data, buffer.size,
+                                    image_format_content_type(req->format), buffer.mtime);
+        if (rendered) {
+            *rendered = buffer;
+        } else {
+            g_free(buffer.data);
+        }
     }
     
+    // Hand the result over to the threads and processes waiting on this key
+    render_done(render, claim, cache_path, status);
+    
     if (status == 0) {
-        INFO_LOG(r, "Image processed and cached successfully");
-    } else if (status == -2) {
-        WARNING_LOG(r, "Source image not found, returning 404");
-        return -2; // Return special code for image not found
+        RENDER_INFO_LOG(ctx, "Image processed and cached successfully");
+    } else if (status == IMAGE_NOT_FOUND) {
+        RENDER_WARNING_LOG(ctx, "Source image not found, returning 404");
+    } else if (status == IMAGE_TOO_LARGE) {
+        RENDER_WARNING_LOG(ctx, "Source image exceeds the pixel budget, returning 422");
+    } else if (status == IMAGE_BUSY) {
+        RENDER_WARNING_LOG(ctx, "Render refused by admission control, returning 503");
     } else {
-        ERROR_LOG(r, "Failed to process image for cache");
+        RENDER_ERROR_LOG(ctx, "Failed to process image for cache");
     }
     
     return status;
 }
 
+// Encode a cache entry again at full effort, for ImageResizeTwoTierEncode. The
+// key is claimed like a render of image_resize_render_cached(), so no request
+// renders it meanwhile, and the entry is only replaced if it still holds a render
+// of the source as it is now. Replacements update the memory cache.
+int image_resize_reencode_cached(const image_render_ctx *ctx, const image_resize_config *cfg,
+                                 const image_request *req, const char *cache_path) {
+    image_buffer buffer = { NULL, 0, 0 };
+    inflight_render *render = NULL;
+    render_registry_claim claim = REGISTRY_UNAVAILABLE;
+    apr_finfo_t finfo;
+    int status;
+    
+    // A render of the key already in progress in this child replaces the entry
+    if (cfg->enable_mutex && inflight_initialized) {
+        int leader;
+        render = inflight_join(cache_path, &leader);
+        if (!leader) {
+            inflight_wait(render);
+            RENDER_DEBUG_LOG(ctx, "%s rendered again meanwhile, re-encode skipped", cache_path);
+            return IMAGE_SUPERSEDED;
+        }
+    }
+    if (cfg->enable_mutex) {
+        claim = render_registry_claim_key(ctx, cache_path, apr_time_from_sec(cfg->render_timeout));
+    }
+    
+    // Entries evicted in the meantime are not brought back: requests waiting on
+    // the key find it missing and render it themselves
+    if (apr_stat(&finfo, cache_path, APR_FINFO_TYPE, ctx->pool) != APR_SUCCESS) {
+        render_done(render, claim, cache_path, 0);
+        return IMAGE_SUPERSEDED;
+    }
+    
+    status = image_resize_process_image(ctx, cfg, req, cache_path, IMAGE_RENDER_REPLACE,
+                                        image_resize_memcache_max_size(cache_path) > 0 ? &buffer : NULL);
+    if (status == 0 && buffer.data) {
+        image_resize_memcache_store(cache_path, buffer.data, buffer.size,
+                                    image_format_content_type(req->format), buffer.mtime);
+    }
+    g_free(buffer.data);
+    
+    // Requests waiting on the key read the entry, replaced or not
+    render_done(render, claim, cache_path, status == IMAGE_SUPERSEDED ? 0 : status);
+    
+    return status;
+}
+
+// A variant of a batch render, with the render locks taken for it
+typedef struct {
+    image_variant variant;        // Output handed to the render pipeline
+    const image_resize_size *size; // Requested size
+    inflight_render *render;      // In-flight entry of this child
+    int leader;                   // Set when this thread renders the variant
+    render_registry_claim claim;  // Claim in the cross-process registry
+} batch_variant;
+
+// Order batch variants by cache path, so that all processes claim keys in the same order
+static int batch_variant_compare(const void *a, const void *b) {
+    return strcmp(((const batch_variant *)a)->variant.output_path,
+                  ((const batch_variant *)b)->variant.output_path);
+}
+
+// Check if a cache entry exists and, with ImageResizeCheckMTime, is not older than its source
+static int cache_entry_fresh(apr_pool_t *p, const image_resize_config *cfg,
+                             const char *cache_path, apr_time_t source_mtime) {
+    apr_finfo_t finfo;
+    
+    if (apr_stat(&finfo, cache_path, APR_FINFO_MTIME, p) != APR_SUCCESS) {
+        return 0;
+    }
+    return !cfg->check_source_mtime || finfo.mtime >= source_mtime;
+}
+
+// Render several sizes of one source through the cache and render locks, decoding
+// the source once for all the sizes missing from the cache. Returns the status of
+// the first size.
+int image_resize_render_cached_variants(const image_render_ctx *ctx, const image_resize_config *cfg,
+                                        const char *filename, image_format format,
+                                        const image_resize_size *sizes, int nsizes) {
+    batch_variant *batch = apr_pcalloc(ctx->pool, nsizes * sizeof(batch_variant));
+    image_variant *variants = apr_pcalloc(ctx->pool, nsizes * sizeof(image_variant));
+    const char *source_path = apr_pstrcat(ctx->pool, cfg->image_dir, "/", filename, NULL);
+    apr_finfo_t source_finfo;
+    int first_status = 0;
+    int nvariants = 0;
+    int i;
+    
+    if (apr_stat(&source_finfo, source_path, APR_FINFO_MTIME, ctx->pool) != APR_SUCCESS) {
+        RENDER_WARNING_LOG(ctx, "Source image not found: %s", source_path);
+        return IMAGE_NOT_FOUND;
+    }
+    
+    for (i = 0; i < nsizes; i++) {
+        image_request req;
+        req.filename = filename;
+        req.width = sizes[i].width;
+        req.height = sizes[i].height;
+        req.format = format;
+        req.quality = 0;
+        req.fit = IMAGE_FIT_CONTAIN;
+        batch[i].size = &sizes[i];
+        batch[i].variant.width = sizes[i].width;
+        batch[i].variant.height = sizes[i].height;
+        batch[i].variant.output_path = image_resize_cache_path(ctx->pool, cfg, &req);
+        batch[i].variant.status = 0;
+        batch[i].claim = REGISTRY_UNAVAILABLE;
+    }
+    qsort(batch, nsizes, sizeof(batch_variant), batch_variant_compare);
+    
+    // Take the locks of every missing variant. A variant already rendered by
+    // another thread of this child is waited for at the end.
+    for (i = 0; i < nsizes; i++) {
+        batch_variant *b = &batch[i];
+        
+        if (cache_entry_fresh(ctx->pool, cfg, b->variant.output_path, source_finfo.mtime)) {
+            continue;
+        }
+        
+        b->leader = 1;
+        if (cfg->enable_mutex && inflight_initialized) {
+            b->render = inflight_join(b->variant.output_path, &b->leader);
+            if (!b->leader) {
+                continue;
+            }
+        }
+        if (cfg->enable_mutex) {
+            b->claim = render_registry_claim_key(ctx, b->variant.output_path,
+                                                 apr_time_from_sec(cfg->render_timeout));
+        }
+        
+        // Another thread or process might have rendered it in the meantime
+        if ((b->render || b->claim != REGISTRY_UNAVAILABLE) &&
+            cache_entry_fresh(ctx->pool, cfg, b->variant.output_path, source_finfo.mtime)) {
+            render_done(b->render, b->claim, b->variant.output_path, 0);
+            b->leader = 0;
+            b->render = NULL;
+            continue;
+        }
+        
+        variants[nvariants++] = b->variant;
+    }
+    
+    if (nvariants > 0) {
+        // Every thread of the batch holds a render slot: the one of the request,
+        // plus those still free, so the batch never runs more renders than
+        // ImageResizeMaxConcurrentRenders allows
+        if (render_admit(ctx) == 0) {
+            int extra = render_admit_extra(ctx, nvariants - 1);
+            image_resize_process_variants(ctx, cfg, filename, format, variants, nvariants,
+                                          1 + extra);
+            render_release_extra(ctx, extra);
+            render_release(ctx);
+        } else {
+            for (i = 0; i < nvariants; i++) {
+                variants[i].status = IMAGE_BUSY;
+            }
+        }
+    }
+    
+    // Publish the results, then collect those of the variants rendered by other threads
+    for (i = 0, nvariants = 0; i < nsizes; i++) {
+        batch_variant *b = &batch[i];
+        if (b->leader) {
+            b->variant.status = variants[nvariants++].status;
+            render_done(b->render, b->claim, b->variant.output_path, b->variant.status);
+        }
+    }
+    for (i = 0; i < nsizes; i++) {
+        batch_variant *b = &batch[i];
+        if (!b->leader && b->render) {
+            b->variant.status = inflight_wait(b->render);
+        }
+        if (b->variant.status == 0) {
+            RENDER_DEBUG_LOG(ctx, "Variant %dx%d of %s is in the cache",
+                             b->variant.width, b->variant.height, filename);
+        }
+        if (b->size == &sizes[0]) {
+            first_status = b->variant.status;
+        }
+    }
+    
+    return first_status;
+}
+
 // Module cleanup function - called when pools are cleaned up
 static apr_status_t image_resize_cleanup(void *data) {
     server_rec *s = (server_rec *)data;
@@ -441,53 +965,504 @@ static apr_status_t image_resize_cleanup(void *data) {
     return APR_SUCCESS;
 }
 
+// Pick a libvips pipeline width so that all the renders of the server together
+// use about one thread per core. Each child runs up to ThreadsPerChild renders,
+// or ImageResizeMaxConcurrentRenders when lower, and there are up to
+// MaxRequestWorkers / ThreadsPerChild children.
+static int auto_vips_concurrency(const image_resize_server_config *scfg) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = 1;
+    int daemons = 1;
+    long renders;
+    
+    if (ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads) != APR_SUCCESS || threads < 1) {
+        threads = 1;
+    }
+    if (ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &daemons) != APR_SUCCESS || daemons < 1) {
+        daemons = 1;
+    }
+    if (scfg->max_renders > 0 && scfg->max_renders < threads) {
+        threads = scfg->max_renders;
+    }
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    
+    renders = (long)threads * daemons;
+    return renders >= cpus ? 1 : (int)(cpus / renders);
+}
+
 // Child initialization function - called for each child process
 static void child_init(apr_pool_t *p, server_rec *s) {
+    // Create the per-key render locks of this child
+    apr_status_t status = inflight_init(p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, 
+                    "mod_image_resize: unable to create render locks, renders will not be deduplicated");
+    }
+    
+    // Create the negative cache lock of this child
+    status = apr_thread_mutex_create(&negative_cache_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, 
+                    "mod_image_resize: unable to create negative cache mutex, negative cache disabled");
+        negative_cache_mutex = NULL;
+    }
+    
+    // Create the source modification time cache lock of this child
+    status = apr_thread_mutex_create(&mtime_cache_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, 
+                    "mod_image_resize: unable to create mtime cache mutex, sources will be stat'ed on every check");
+        mtime_cache_mutex = NULL;
+    }
+    
+    // Create the render slots of this child
+    status = render_admission_init(p, ap_get_module_config(s->module_config, &image_resize_module));
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, 
+                    "mod_image_resize: unable to create render slots, renders will not be limited");
+        admission.max_renders = 0;
+    }
+    
+    // Reattach the cross-process render registry mutex
+    if (render_registry_mutex) {
+        status = apr_global_mutex_child_init(&render_registry_mutex,
+                                             apr_global_mutex_lockfile(render_registry_mutex), p);
+        if (status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, s, 
+                        "mod_image_resize: unable to attach render registry mutex, "
+                        "renders will not be deduplicated across processes");
+            render_registry = NULL;
+        }
+    }
+    
+    // Reattach the shared memory cache mutex
+    image_resize_memcache_child_init(p, s);
+    
     // Initialize libvips in each child process
-    if (VIPS_INIT("mod_image_resize")) {
+    image_resize_server_config *scfg = ap_get_module_config(s->module_config, &image_resize_module);
+    image_vips_tuning tuning = scfg->vips;
+    if (scfg->vips_concurrency_auto) {
+        tuning.concurrency = auto_vips_concurrency(scfg);
+    }
+    if (image_resize_render_init("mod_image_resize", &tuning) != 0) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, 
                     "mod_image_resize: could not initialize libvips: %s", 
                     vips_error_buffer());
         vips_error_clear();
     } else {
-        libvips_initialized = 1;
         ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, 
                     "mod_image_resize: libvips initialized in child process (using libvips %s)", 
                     vips_version_string());
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, 
+                    "mod_image_resize: libvips concurrency %d, operation cache of %d operations, "
+                    "%" APR_SIZE_T_FMT " bytes and %d files",
+                    vips_concurrency_get(), vips_cache_get_max(),
+                    vips_cache_get_max_mem(), vips_cache_get_max_files());
+        
+        // Start the background renders once libvips is ready
+        image_resize_prewarm_child_init(p, s);
+        
+        // Start the size limit of the disk cache
+        image_resize_janitor_child_init(p, s);
+        
+        // Start the full-effort encodes of the two-tier mode
+        image_resize_reencode_child_init(p, s);
     }
 }
 
-// Module initialization function - called at server startup
-static int image_resize_init(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s) {
-    // Create cache mutex
-    apr_status_t status = apr_thread_mutex_create(&cache_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+// Pre-configuration function - registers the mutex types of the module
+static int image_resize_pre_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp) {
+    apr_status_t status = ap_mutex_register(p, render_registry_mutex_type, NULL,
+                                            APR_LOCK_DEFAULT, 0);
     if (status != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, 
-                    "mod_image_resize: unable to create cache mutex");
+        ap_log_perror(APLOG_MARK, APLOG_ERR, status, plog, 
+                     "mod_image_resize: unable to register %s mutex", render_registry_mutex_type);
         return HTTP_INTERNAL_SERVER_ERROR;
     }
     
-    // Do NOT initialize libvips here - it will be done in child_init
-    
-    // Register cleanup function
-    apr_pool_cleanup_register(p, s, image_resize_cleanup, apr_pool_cleanup_null);
+    status = image_resize_memcache_pre_config(p);
+    if (status != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, status, plog, 
+                     "mod_image_resize: unable to register memory cache mutex");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
     
-    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, 
-                "mod_image_resize: module initialized");
+    status = image_resize_prewarm_pre_config(p);
+    if (status != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, status, plog, 
+                     "mod_image_resize: unable to register prewarm mutex");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    
+    status = image_resize_janitor_pre_config(p);
+    if (status != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_ERR, status, plog, 
+                     "mod_image_resize: unable to register cache janitor mutex");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    
+    return OK;
+}
+
+// Module initialization function - called at server startup
+static int image_resize_init(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s) {
+    apr_status_t status;
+    
+    // Nothing to share during the first configuration pass
+    if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG) {
+        return OK;
+    }
+    
+    // Create the cross-process registry of renders in progress
+    status = ap_global_mutex_create(&render_registry_mutex, NULL, render_registry_mutex_type,
+                                    NULL, s, p, 0);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, 
+                    "mod_image_resize: unable to create render registry mutex");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    
+    status = apr_shm_create(&render_registry_shm,
+                            sizeof(render_registry_slot) * RENDER_REGISTRY_SLOTS, NULL, p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s, 
+                    "mod_image_resize: unable to create render registry shared memory");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    render_registry = apr_shm_baseaddr_get(render_registry_shm);
+    memset(render_registry, 0, sizeof(render_registry_slot) * RENDER_REGISTRY_SLOTS);
+    
+    // Create the shared memory cache of hot images
+    image_resize_server_config *scfg = ap_get_module_config(s->module_config, &image_resize_module);
+    status = image_resize_memcache_create(p, s, scfg->mem_cache_size);
+    if (status != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    
+    // Create the leader election mutex of the background renders
+    status = image_resize_prewarm_create(p, s);
+    if (status != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    
+    // Create the cache counters and the election mutex of the cache janitor
+    status = image_resize_janitor_create(p, s);
+    if (status != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    
+    // Create the shared request statistics
+    status = image_resize_stats_create(p, s);
+    if (status != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    
+    // Do NOT initialize libvips here - it will be done in child_init
+    
+    // Register cleanup function
+    apr_pool_cleanup_register(p, s, image_resize_cleanup, apr_pool_cleanup_null);
+    
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, 
+                "mod_image_resize: module initialized");
+    
+    return OK;
+}
+
+// Check if the source of a request was modified after the given time
+static int source_newer_than(request_rec *r, const image_resize_config *cfg,
+                             const image_request *req, apr_time_t mtime) {
+    apr_time_t source_time;
+    const char *source_path = apr_pstrcat(r->pool, cfg->image_dir, "/", req->filename, NULL);
+    
+    if (source_mtime(r->pool, cfg, source_path, &source_time) != APR_SUCCESS) {
+        return 0; // Keep serving the cached version
+    }
+    return source_time > mtime;
+}
+
+// Set Content-Type, Cache-Control and Expires headers of a response
+static void set_cache_headers(request_rec *r, const image_resize_config *cfg,
+                              const char *content_type) {
+    char date_str[APR_RFC822_DATE_LEN];
+    
+    ap_set_content_type(r, content_type);
+    DEBUG_LOG(r, "Content-Type set: %s", content_type);
+    
+    // Set Cache-Control
+    char cache_control[100];
+    apr_snprintf(cache_control, sizeof(cache_control), "max-age=%d", cfg->cache_max_age);
+    apr_table_set(r->headers_out, "Cache-Control", cache_control);
+    
+    // Set expiration date
+    apr_time_t expires = apr_time_now() + (apr_time_t)cfg->cache_max_age * APR_USEC_PER_SEC;
+    apr_rfc822_date(date_str, expires);
+    apr_table_set(r->headers_out, "Expires", date_str);
+}
+
+// Set a strong ETag for a cached image. It only depends on the source modification
+// time (also the one of the cache file), the encoded size and the render
+// parameters, so it is known without reading the image.
+static void set_etag(request_rec *r, const image_resize_config *cfg,
+                     const image_request *req, apr_off_t size, apr_time_t mtime) {
+    char params[64];
+    
+    apr_snprintf(params, sizeof(params), "%dx%d-%s-%d%s", req->width, req->height,
+                 image_format_name(req->format), image_request_quality(req, cfg),
+                 req->fit != IMAGE_FIT_CONTAIN ? image_fit_name(req->fit) : "");
+    apr_table_setn(r->headers_out, "ETag",
+                   apr_psprintf(r->pool, "\"%" APR_UINT64_T_HEX_FMT "-%" APR_UINT64_T_HEX_FMT "-%08x\"",
+                                (apr_uint64_t)mtime, (apr_uint64_t)size,
+                                image_resize_hash_string(params)));
+}
+
+// Set Last-Modified and ETag for a cached image, and evaluate the conditional
+// headers of the request. Returns OK, or the status to return (304 or 412).
+static int set_validators(request_rec *r, const image_resize_config *cfg,
+                          const image_request *req, apr_off_t size, apr_time_t mtime) {
+    ap_update_mtime(r, mtime);
+    ap_set_last_modified(r);
+    set_etag(r, cfg, req, size, mtime);
+    
+    return ap_meets_conditions(r);
+}
+
+// Upgrade JPEG and PNG to the best format the client accepts. Each format has
+// its own cache entry, and shared caches must key the response on Accept.
+// Returns 1 when the response varies on Accept.
+static int negotiate_format(request_rec *r, const image_resize_config *cfg, image_request *req) {
+    image_format requested = req->format;
+    
+    if (!cfg->negotiate) {
+        return 0;
+    }
+    req->format = image_resize_negotiate_format(apr_table_get(r->headers_in, "Accept"), requested);
+    if (req->format != requested) {
+        DEBUG_LOG(r, "Negotiated format: %s", image_format_name(req->format));
+    }
+    return requested == IMAGE_FORMAT_JPEG || requested == IMAGE_FORMAT_PNG;
+}
+
+// Send an image held in memory as the response body
+static int send_image_bytes(request_rec *r, const image_render_ctx *ctx,
+                            apr_bucket *body, apr_size_t size) {
+    apr_time_t start = image_resize_clock();
+    
+    ap_set_content_length(r, size);
+    
+    apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    if (!r->header_only) {
+        APR_BRIGADE_INSERT_TAIL(bb, body);
+    } else {
+        apr_bucket_destroy(body);
+    }
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(r->connection->bucket_alloc));
+    
+    if (ap_pass_brigade(r->output_filters, bb) != APR_SUCCESS) {
+        DEBUG_LOG(r, "Client connection aborted while sending image");
+    }
+    
+    image_render_phase_end(ctx, IMAGE_PHASE_SEND, start);
+    return OK;
+}
+
+// Send an open cache file as the response body, and close it
+static int send_image_file(request_rec *r, const image_render_ctx *ctx,
+                           apr_file_t *fd, apr_off_t size) {
+    apr_time_t start;
+    apr_size_t sent;
+    
+    // Set content length
+    ap_set_content_length(r, size);
+    
+    // Send response body
+    if (r->header_only) {
+        apr_file_close(fd);
+        return OK;
+    }
+    
+    start = image_resize_clock();
+    ap_send_fd(fd, r, 0, size, &sent);
+    image_render_phase_end(ctx, IMAGE_PHASE_SEND, start);
+    
+    // Close file
+    apr_file_close(fd);
     
     return OK;
 }
 
+// Render a missing image together with the ImageResizePrewarm sizes of its source,
+// from a single decode, as the other sizes of a srcset are usually requested next
+static int render_with_siblings(const image_render_ctx *ctx, const image_resize_config *cfg,
+                                const image_request *req) {
+    image_resize_size *sizes = apr_palloc(ctx->pool,
+                                          (cfg->prewarm_sizes->nelts + 1) * sizeof(image_resize_size));
+    int nsizes = 1;
+    int i;
+    
+    sizes[0].width = req->width;
+    sizes[0].height = req->height;
+    for (i = 0; i < cfg->prewarm_sizes->nelts; i++) {
+        const image_resize_size *size = &APR_ARRAY_IDX(cfg->prewarm_sizes, i, image_resize_size);
+        if (size->width != req->width || size->height != req->height) {
+            sizes[nsizes++] = *size;
+        }
+    }
+    
+    RENDER_DEBUG_LOG(ctx, "Rendering %s with %d sibling sizes", req->filename, nsizes - 1);
+    return image_resize_render_cached_variants(ctx, cfg, req->filename, req->format, sizes, nsizes);
+}
+
+// Apply ImageResizeMaxDimension and ImageResizeAllowedSizes to a request, before
+// any filesystem or libvips work. With ImageResizeSnapSizes, a size missing from
+// the list is replaced by the smallest allowed size covering it, or else by the
+// largest allowed size. Returns OK to render the size of the request, snapped or
+// not, HTTP_MOVED_TEMPORARILY to redirect to the snapped size, or HTTP_BAD_REQUEST.
+static int check_request_size(const image_resize_config *cfg, image_request *req) {
+    const image_resize_size *sizes, *best = NULL, *largest = NULL;
+    int i;
+    
+    if (cfg->max_dimension > 0 &&
+        (req->width > cfg->max_dimension || req->height > cfg->max_dimension)) {
+        return HTTP_BAD_REQUEST;
+    }
+    if (!cfg->allowed_sizes) {
+        return OK;
+    }
+    
+    sizes = (const image_resize_size *)cfg->allowed_sizes->elts;
+    for (i = 0; i < cfg->allowed_sizes->nelts; i++) {
+        apr_int64_t area = (apr_int64_t)sizes[i].width * sizes[i].height;
+        
+        if (sizes[i].width == req->width && sizes[i].height == req->height) {
+            return OK;
+        }
+        if (sizes[i].width >= req->width && sizes[i].height >= req->height &&
+            (!best || area < (apr_int64_t)best->width * best->height)) {
+            best = &sizes[i];
+        }
+        if (!largest || area > (apr_int64_t)largest->width * largest->height) {
+            largest = &sizes[i];
+        }
+    }
+    if (cfg->snap_sizes == IMAGE_SNAP_OFF) {
+        return HTTP_BAD_REQUEST;
+    }
+    
+    if (!best) {
+        best = largest;
+    }
+    req->width = best->width;
+    req->height = best->height;
+    return cfg->snap_sizes == IMAGE_SNAP_REDIRECT ? HTTP_MOVED_TEMPORARILY : OK;
+}
+
+// Absolute URL of a request snapped to another size: the size segment of the
+// URI is replaced, its options, the path and the query string are kept
+static const char *snapped_url(request_rec *r, const image_request *req) {
+    const char *end = req->filename - 1;  // Slash ending the size segment
+    const char *start = end;
+    const char *options;
+    const char *path;
+    
+    while (start > r->uri && start[-1] != '/') {
+        start--;
+    }
+    options = memchr(start, ',', end - start);
+    path = apr_psprintf(r->pool, "%.*s%dx%d%.*s%s", (int)(start - r->uri), r->uri,
+                        req->width, req->height,
+                        options ? (int)(end - options) : 0, options ? options : "", end);
+    path = ap_construct_url(r->pool, ap_escape_uri(r->pool, path), r);
+    return r->args ? apr_pstrcat(r->pool, path, "?", r->args, NULL) : path;
+}
+
+// Note set on the requests mapped by the fast path, holding their Content-Type
+#define IMAGE_FAST_PATH_NOTE "image-resize-fast-path"
+
+// Renders of a request whose cache file is removed before it could be read
+#define CACHE_REOPEN_ATTEMPTS 2
+
+// With ImageResizeFastPath, serve fresh cache hits without the image handler:
+// map the URL to its cache file in translate_name, where the <Location>
+// configuration is known, and let the handler send it with sendfile. Misses,
+// stale entries and invalid URLs take the full path of the handler.
+static int image_resize_translate(request_rec *r) {
+    image_resize_config *cfg = ap_get_module_config(r->per_dir_config, &image_resize_module);
+    image_request parsed;
+    image_render_ctx ctx;
+    const char *cache_path;
+    apr_finfo_t finfo;
+    apr_time_t start;
+    int vary;
+    
+    if (!cfg || !cfg->fast_path || r->method_number != M_GET) {
+        return DECLINED;
+    }
+    
+    image_resize_stats_begin(r);
+    request_render_ctx(r, &ctx);
+    start = image_resize_clock();
+    if (image_resize_parse_url(r->uri, &parsed) != 0 || check_request_size(cfg, &parsed) != OK) {
+        return DECLINED;
+    }
+    vary = negotiate_format(r, cfg, &parsed);
+    image_render_phase_end(&ctx, IMAGE_PHASE_PARSE, start);
+    
+    start = image_resize_clock();
+    cache_path = image_resize_cache_path(r->pool, cfg, &parsed);
+    if (apr_stat(&finfo, cache_path, APR_FINFO_MIN, r->pool) != APR_SUCCESS ||
+        finfo.filetype != APR_REG) {
+        image_render_phase_end(&ctx, IMAGE_PHASE_CACHE, start);
+        return DECLINED;
+    }
+    if (cfg->check_source_mtime) {
+        const char *source_path = apr_pstrcat(r->pool, cfg->image_dir, "/", parsed.filename, NULL);
+        apr_time_t mtime;
+        if (source_mtime(r->pool, cfg, source_path, &mtime) == APR_SUCCESS && mtime > finfo.mtime) {
+            image_render_phase_end(&ctx, IMAGE_PHASE_CACHE, start);
+            return DECLINED;
+        }
+    }
+    image_render_phase_end(&ctx, IMAGE_PHASE_CACHE, start);
+    ctx.timings->cache_result = "disk";
+    image_resize_janitor_record(cache_path, 1);
+    
+    DEBUG_LOG(r, "Fast path: serving %s", cache_path);
+    r->filename = apr_pstrdup(r->pool, cache_path);
+    r->canonical_filename = r->filename;
+    r->finfo = finfo;
+    set_cache_headers(r, cfg, image_format_content_type(parsed.format));
+    set_etag(r, cfg, &parsed, finfo.size, finfo.mtime);
+    if (vary) {
+        apr_table_mergen(r->headers_out, "Vary", "Accept");
+    }
+    apr_table_setn(r->notes, IMAGE_FAST_PATH_NOTE, image_format_content_type(parsed.format));
+    
+    return OK;
+}
+
+// Skip the directory walk of the cache files mapped by the fast path: they are
+// served with the access rules of the <Location>, like the handler's responses
+static int image_resize_map_to_storage(request_rec *r) {
+    return apr_table_get(r->notes, IMAGE_FAST_PATH_NOTE) ? OK : DECLINED;
+}
+
 // HTTP request handler
 static int image_resize_handler(request_rec *r) {
     image_resize_config *cfg;
-    image_request *req;
-    char cache_path[512];
+    image_request parsed;
+    const image_request *req = &parsed;
+    const char *cache_path;
+    image_buffer rendered = { NULL, 0, 0 };
     apr_file_t *fd;
     apr_finfo_t finfo;
     apr_status_t rv;
-    char date_str[APR_RFC822_DATE_LEN];
     const char *content_type;
+    char errbuf[100];
+    image_render_ctx ctx;
+    apr_time_t start;
+    int status;
     
     // Check if this is our handler
     if (!r->handler || strcmp(r->handler, "image-resize") != 0)
@@ -497,85 +1472,226 @@ static int image_resize_handler(request_rec *r) {
     if (r->method_number != M_GET)
         return HTTP_METHOD_NOT_ALLOWED;
     
+    // Cache hit mapped by the fast path: the file is opened here rather than left
+    // to the core handler, so that an entry removed by the janitor or replaced
+    // since the translation falls back to the full path instead of a 404 or a
+    // stale ETag
+    if ((content_type = apr_table_get(r->notes, IMAGE_FAST_PATH_NOTE))) {
+        request_render_ctx(r, &ctx);
+        rv = apr_file_open(&fd, r->filename, APR_READ | APR_SENDFILE_ENABLED, APR_OS_DEFAULT, r->pool);
+        if (rv == APR_SUCCESS &&
+            apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, fd) == APR_SUCCESS &&
+            finfo.size == r->finfo.size && finfo.mtime == r->finfo.mtime) {
+            ap_set_content_type(r, content_type);
+            ap_update_mtime(r, finfo.mtime);
+            ap_set_last_modified(r);
+            if ((status = ap_meets_conditions(r)) != OK) {
+                apr_file_close(fd);
+                return status;
+            }
+            return send_image_file(r, &ctx, fd, finfo.size);
+        }
+        if (rv == APR_SUCCESS) {
+            apr_file_close(fd);
+        } else if (!APR_STATUS_IS_ENOENT(rv)) {
+            ERROR_LOG(r, "Cannot open cached file: %s", apr_strerror(rv, errbuf, sizeof(errbuf)));
+            return HTTP_NOT_FOUND;
+        }
+        INFO_LOG(r, "Cached file changed since the fast path mapped it, taking the full path");
+        apr_table_unset(r->notes, IMAGE_FAST_PATH_NOTE);
+        apr_table_unset(r->headers_out, "ETag");
+        apr_table_unset(r->headers_out, "Vary");
+    }
+    
     // Get module configuration
     cfg = (image_resize_config*) ap_get_module_config(r->per_dir_config, &image_resize_module);
     
     INFO_LOG(r, "New request: %s", r->uri);
     
+    // Time the phases of the request, published when it is logged
+    image_resize_stats_begin(r);
+    request_render_ctx(r, &ctx);
+    start = image_resize_clock();
+    
     // Parse URL
-    req = parse_url(r, r->uri);
-    if (!req) {
+    if (parse_url(r, r->uri, &parsed) != 0) {
         ERROR_LOG(r, "Invalid URL: %s", r->uri);
         return HTTP_BAD_REQUEST;
     }
     
-    // Check cache and process image if needed
-    int process_result = process_image_with_cache(r, cfg, req, cache_path, sizeof(cache_path));
-    if (process_result == -2) {
+    // Bound the sizes that can be rendered, before any filesystem or libvips work
+    if ((status = check_request_size(cfg, &parsed)) != OK) {
+        if (status == HTTP_MOVED_TEMPORARILY) {
+            const char *location = snapped_url(r, req);
+            INFO_LOG(r, "Size not allowed, redirecting to %s", location);
+            apr_table_setn(r->headers_out, "Location", location);
+        } else {
+            WARNING_LOG(r, "Size %dx%d not allowed", req->width, req->height);
+        }
+        return status;
+    }
+    
+    // Pick the output format from the Accept header, with ImageResizeNegotiate
+    if (negotiate_format(r, cfg, &parsed)) {
+        apr_table_mergen(r->headers_out, "Vary", "Accept");
+    }
+    image_render_phase_end(&ctx, IMAGE_PHASE_PARSE, start);
+    
+    // Sources recently found missing get a 404 without any filesystem access
+    const char *source_path = NULL;
+    if (cfg->negative_cache_ttl > 0) {
+        source_path = apr_pstrcat(r->pool, cfg->image_dir, "/", req->filename, NULL);
+        if (negative_cache_lookup(source_path)) {
+            DEBUG_LOG(r, "Source image known to be missing: %s", source_path);
+            return HTTP_NOT_FOUND;
+        }
+    }
+    
+    // Build cache path preserving subdirectory structure
+    cache_path = image_resize_cache_path(r->pool, cfg, req);
+    
+    // Hot images are served from shared memory without touching the filesystem
+    image_memcache_hit hit;
+    start = image_resize_clock();
+    if (image_resize_memcache_fetch(cache_path, r->pool, &hit)) {
+        if (!cfg->check_source_mtime || !source_newer_than(r, cfg, req, hit.mtime)) {
+            DEBUG_LOG(r, "Image found in memory cache");
+            image_render_phase_end(&ctx, IMAGE_PHASE_CACHE, start);
+            ctx.timings->cache_result = "memory";
+            image_resize_janitor_record(cache_path, 1);
+            set_cache_headers(r, cfg, hit.content_type);
+            if ((status = set_validators(r, cfg, req, hit.size, hit.mtime)) != OK) {
+                return status;
+            }
+            return send_image_bytes(r, &ctx, apr_bucket_pool_create(hit.data, hit.size, r->pool,
+                                                                    r->connection->bucket_alloc),
+                                    hit.size);
+        }
+        INFO_LOG(r, "Source image is newer than image in memory cache, regenerating");
+    }
+    image_render_phase_end(&ctx, IMAGE_PHASE_CACHE, start);
+    
+    int process_result;
+    char options[IMAGE_RESIZE_OPTIONS_SIZE];
+    int reopen_attempts = 0;
+    
+    // Check cache and process image if needed. In stream mode, a render done by
+    // this request hands back its encoded bytes so they are sent from memory.
+    // With ImageResizeRenderSiblings, a miss renders the other prewarm sizes from
+    // the same decode and the response is then read from the cache file. The
+    // prewarm sizes have no URL options, so requests with options render alone.
+render:
+    if (cfg->render_siblings && cfg->prewarm_sizes &&
+        !*image_resize_canonical_options(req, cfg->quality, options, sizeof(options)) &&
+        apr_stat(&finfo, cache_path, APR_FINFO_TYPE, r->pool) != APR_SUCCESS) {
+        image_resize_janitor_record(cache_path, 0);
+        ctx.timings->cache_result = "render";
+        process_result = render_with_siblings(&ctx, cfg, req);
+    } else {
+        process_result = image_resize_render_cached(&ctx, cfg, req, cache_path,
+                                                    cfg->stream_render ? &rendered : NULL);
+    }
+    if (process_result == IMAGE_NOT_FOUND) {
         WARNING_LOG(r, "Image source not found");
+        if (source_path) {
+            negative_cache_insert(source_path, cfg->negative_cache_ttl);
+        }
         return HTTP_NOT_FOUND;
+    } else if (process_result == IMAGE_TOO_LARGE) {
+        WARNING_LOG(r, "Image source too large");
+        return HTTP_UNPROCESSABLE_ENTITY;
+    } else if (process_result == IMAGE_BUSY) {
+        WARNING_LOG(r, "Too many renders in progress");
+        apr_table_setn(r->err_headers_out, "Retry-After",
+                       apr_itoa(r->pool, admission.timeout > apr_time_from_sec(1) ?
+                                         (int)apr_time_sec(admission.timeout) : 1));
+        return HTTP_SERVICE_UNAVAILABLE;
     } else if (process_result != 0) {
         ERROR_LOG(r, "Error processing image");
         return HTTP_INTERNAL_SERVER_ERROR;
     }
     
+    // Set response headers based on format
+    content_type = image_format_content_type(req->format);
+    set_cache_headers(r, cfg, content_type);
+    
+    // Freshly rendered image: send the encoded bytes without reopening the cache file.
+    // The heap bucket takes ownership of the libvips buffer.
+    if (rendered.data) {
+        DEBUG_LOG(r, "Streaming rendered image from memory");
+        if ((status = set_validators(r, cfg, req, rendered.size, rendered.mtime)) != OK) {
+            g_free(rendered.data);
+            return status;
+        }
+        return send_image_bytes(r, &ctx, apr_bucket_heap_create(rendered.data, rendered.size, g_free,
+                                                                r->connection->bucket_alloc),
+                                rendered.size);
+    }
+    
+    // Answer conditional requests from the metadata of the cache file, without
+    // opening it. The janitor can remove the entry between the check of the
+    // render and its opening below: it is then rendered again rather than
+    // answered with a 404.
+    if ((rv = apr_stat(&finfo, cache_path, APR_FINFO_SIZE | APR_FINFO_MTIME, r->pool)) != APR_SUCCESS) {
+        if (APR_STATUS_IS_ENOENT(rv) && reopen_attempts++ < CACHE_REOPEN_ATTEMPTS) {
+            INFO_LOG(r, "Cached file removed before it was read, rendering it again");
+            goto render;
+        }
+        ERROR_LOG(r, "Cannot stat cached file: %s", 
+                 apr_strerror(rv, errbuf, sizeof(errbuf)));
+        return HTTP_NOT_FOUND;
+    }
+    if ((status = set_validators(r, cfg, req, finfo.size, finfo.mtime)) != OK) {
+        DEBUG_LOG(r, "Conditional request answered with %d", status);
+        return status;
+    }
+    
     // Open cached file
     DEBUG_LOG(r, "Opening cached file: %s", cache_path);
     if ((rv = apr_file_open(&fd, cache_path, APR_READ, APR_OS_DEFAULT, r->pool)) != APR_SUCCESS) {
+        if (APR_STATUS_IS_ENOENT(rv) && reopen_attempts++ < CACHE_REOPEN_ATTEMPTS) {
+            INFO_LOG(r, "Cached file removed before it was opened, rendering it again");
+            goto render;
+        }
         ERROR_LOG(r, "Cannot open cached file: %s", 
-                 apr_strerror(rv, cache_path, 100));
+                 apr_strerror(rv, errbuf, sizeof(errbuf)));
         return HTTP_NOT_FOUND;
     }
     
-    // Get file size
-    if ((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, fd)) != APR_SUCCESS) {
+    // Get file size, from the file actually opened in case it was replaced since
+    // the stat, and evaluate the conditional headers again against the validators
+    // of that file
+    if ((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, fd)) != APR_SUCCESS) {
         ERROR_LOG(r, "Cannot get file size: %s",
-                 apr_strerror(rv, cache_path, 100));
+                 apr_strerror(rv, errbuf, sizeof(errbuf)));
         apr_file_close(fd);
         return HTTP_INTERNAL_SERVER_ERROR;
     }
-    
-    // Set response headers based on format
-    if (strcmp(req->format, "jpg") == 0) {
-        content_type = "image/jpeg";
-    } else if (strcmp(req->format, "png") == 0) {
-        content_type = "image/png";
-    } else if (strcmp(req->format, "gif") == 0) {
-        content_type = "image/gif";
-    } else if (strcmp(req->format, "webp") == 0) {
-        content_type = "image/webp";
-    } else {
-        content_type = "image/jpeg"; // default
+    if ((status = set_validators(r, cfg, req, finfo.size, finfo.mtime)) != OK) {
+        DEBUG_LOG(r, "Conditional request answered with %d", status);
+        apr_file_close(fd);
+        return status;
     }
     
-    ap_set_content_type(r, content_type);
-    DEBUG_LOG(r, "Content-Type set: %s", content_type);
-    
-    // Set Cache-Control
-    char cache_control[100];
-    apr_snprintf(cache_control, sizeof(cache_control), "max-age=%d", cfg->cache_max_age);
-    apr_table_set(r->headers_out, "Cache-Control", cache_control);
-    
-    // Set expiration date
-    apr_time_t expires = apr_time_now() + (apr_time_t)cfg->cache_max_age * APR_USEC_PER_SEC;
-    apr_rfc822_date(date_str, expires);
-    apr_table_set(r->headers_out, "Expires", date_str);
-    
-    // Set content length
-    ap_set_content_length(r, finfo.size);
-    
-    // Send response body
-    if (r->header_only) {
+    // Promote the image to the memory cache, and send it from the bytes just read
+    if (finfo.size <= (apr_off_t)image_resize_memcache_max_size(cache_path)) {
+        apr_size_t size = finfo.size;
+        char *data = apr_palloc(r->pool, size);
+        
+        rv = apr_file_read_full(fd, data, size, NULL);
         apr_file_close(fd);
-        return OK;
+        if (rv != APR_SUCCESS) {
+            ERROR_LOG(r, "Cannot read cached file: %s", apr_strerror(rv, errbuf, sizeof(errbuf)));
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        
+        image_resize_memcache_store(cache_path, data, size, content_type, finfo.mtime);
+        return send_image_bytes(r, &ctx, apr_bucket_pool_create(data, size, r->pool,
+                                                                r->connection->bucket_alloc),
+                                size);
     }
     
-    rv = ap_send_fd(fd, r, 0, finfo.size, &finfo.size);
-    
-    // Close file
-    apr_file_close(fd);
-    
-    return OK;
+    return send_image_file(r, &ctx, fd, finfo.size);
 }
 
 // Create per-directory configuration structure
@@ -590,11 +1706,55 @@ static void *create_dir_config(apr_pool_t *p, char *arg) {
         cfg->cache_max_age = 86400;             // Default cache lifetime (1 day)
         cfg->enable_mutex = 1;                  // Mutex enabled by default
         cfg->check_source_mtime = 0;            // Source mtime check disabled by default
+        cfg->render_timeout = 30;               // Wait up to 30s for a render in another process
+        cfg->stream_render = 0;                 // Cache misses reopen the cache file by default
+        cfg->max_pixels = 0;                    // No limit on source image size by default
+        cfg->max_frames = 0;                    // Animations are reduced to their first frame by default
+        cfg->negative_cache_ttl = 0;            // Missing sources are not remembered by default
+        cfg->mtime_ttl = 0;                     // Sources stat'ed on every check by default
+        cfg->prewarm_sizes = NULL;              // No background rendering by default
+        cfg->cache_max_bytes = 0;               // Cache size not limited by default
+        cfg->allowed_sizes = NULL;              // Any size may be requested by default
+        cfg->snap_sizes = IMAGE_SNAP_OFF;       // Sizes not allowed are refused
+        cfg->max_dimension = 0;                 // No limit on the requested size by default
+        cfg->render_siblings = 0;               // Cache misses render only the requested size
+        cfg->negotiate = 0;                     // Output format from the URL extension by default
+        cfg->cache_layout = IMAGE_CACHE_LAYOUT_TREE; // Cache mirrors the source tree by default
+        cfg->fast_path = 0;                     // Cache hits go through the handler by default
+        cfg->png_effort = 9;                    // Maximum zlib compression
+        cfg->webp_effort = 4;                   // libwebp default effort
+        cfg->jpeg_trellis = 0;                  // No trellis quantization by default
+        cfg->two_tier = 0;                      // Misses encoded once, at full effort
     }
     
     return cfg;
 }
 
+// Create per-server configuration structure
+static void *create_server_config(apr_pool_t *p, server_rec *s) {
+    image_resize_server_config *scfg = apr_pcalloc(p, sizeof(image_resize_server_config));
+    
+    if (scfg) {
+        scfg->mem_cache_size = 0;               // Memory cache disabled by default
+        scfg->prewarm_configs = apr_array_make(p, 1, sizeof(image_resize_config *));
+        scfg->janitor_configs = apr_array_make(p, 1, sizeof(image_resize_config *));
+        scfg->janitor_interval = 60;            // Cache directories walked every minute
+        scfg->prewarm_threads = 2;              // Two background render threads
+        scfg->two_tier = 0;                     // No re-encode thread by default
+        scfg->max_renders = 0;                  // Renders not limited by default
+        scfg->render_queue = 64;                // Up to 64 requests wait for a render slot
+        scfg->render_queue_timeout = 10;        // Waiting for at most 10 seconds
+        scfg->vips.concurrency = -1;            // libvips defaults for its threads and caches
+        scfg->vips.cache_max = -1;
+        scfg->vips.cache_max_mem = -1;
+        scfg->vips.cache_max_files = -1;
+        scfg->vips.leak = 0;
+        scfg->vips_concurrency_auto = 0;
+    }
+    
+    return scfg;
+}
+
 // Configuration command handlers
 static const char *set_image_dir(cmd_parms *cmd, void *conf, const char *arg) {
     image_resize_config *cfg = (image_resize_config *)conf;
@@ -640,6 +1800,419 @@ static const char *set_check_source_mtime(cmd_parms *cmd, void *conf, int flag)
     return NULL;
 }
 
+static const char *set_render_timeout(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    int val = atoi(arg);
+    if (val <= 0) {
+        return "ImageResizeRenderTimeout must be a positive integer";
+    }
+    cfg->render_timeout = val;
+    return NULL;
+}
+
+static const char *set_stream_render(cmd_parms *cmd, void *conf, int flag) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    cfg->stream_render = flag;
+    return NULL;
+}
+
+static const char *set_max_pixels(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    apr_int64_t val = apr_atoi64(arg);
+    if (val < 0) {
+        return "ImageResizeMaxPixels must be a positive integer (0 for no limit)";
+    }
+    cfg->max_pixels = val;
+    return NULL;
+}
+
+static const char *set_max_frames(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    int val = atoi(arg);
+    if (val < 0) {
+        return "ImageResizeMaxFrames must be a positive integer (0 for the first frame only)";
+    }
+    cfg->max_frames = val;
+    return NULL;
+}
+
+static const char *set_mem_cache_size(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t val;
+    char *end;
+    
+    if (err) {
+        return err;
+    }
+    if (apr_strtoff(&val, arg, &end, 10) != APR_SUCCESS || *end || val < 0) {
+        return "ImageResizeMemCacheSize must be a positive number of bytes (0 to disable)";
+    }
+    // Entries are linked with 32-bit offsets
+    if (val > APR_UINT32_MAX) {
+        return "ImageResizeMemCacheSize must be less than 4 GB";
+    }
+    scfg->mem_cache_size = val;
+    return NULL;
+}
+
+static const char *set_negative_cache_ttl(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    int val = atoi(arg);
+    if (val < 0) {
+        return "ImageResizeNegativeCacheTTL must be a positive integer (0 to disable)";
+    }
+    cfg->negative_cache_ttl = val;
+    return NULL;
+}
+
+static const char *set_fast_path(cmd_parms *cmd, void *conf, int flag) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    cfg->fast_path = flag;
+    return NULL;
+}
+
+static const char *set_png_effort(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    int val = atoi(arg);
+    if (val < 0 || val > 9) {
+        return "ImageResizePNGEffort must be between 0 and 9";
+    }
+    cfg->png_effort = val;
+    return NULL;
+}
+
+static const char *set_webp_effort(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    int val = atoi(arg);
+    if (val < 0 || val > 6) {
+        return "ImageResizeWebPEffort must be between 0 and 6";
+    }
+    cfg->webp_effort = val;
+    return NULL;
+}
+
+static const char *set_jpeg_trellis(cmd_parms *cmd, void *conf, int flag) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    cfg->jpeg_trellis = flag;
+    return NULL;
+}
+
+static const char *set_two_tier(cmd_parms *cmd, void *conf, int flag) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    cfg->two_tier = flag;
+    
+    // Have the children of the server start their re-encode thread
+    if (flag) {
+        scfg->two_tier = 1;
+    }
+    return NULL;
+}
+
+static const char *set_mtime_ttl(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    int val = atoi(arg);
+    if (val < 0) {
+        return "ImageResizeMTimeTTL must be a positive integer (0 to disable)";
+    }
+    cfg->mtime_ttl = val;
+    return NULL;
+}
+
+// Parse a WIDTHxHEIGHT directive argument. Returns 0, or -1 if it is invalid.
+static int parse_size_arg(const char *arg, image_resize_size *size) {
+    char *end;
+    long width, height;
+    
+    width = strtol(arg, &end, 10);
+    if (end == arg || *end != 'x') {
+        return -1;
+    }
+    arg = end + 1;
+    height = strtol(arg, &end, 10);
+    if (end == arg || *end || width <= 0 || height <= 0 || width > INT_MAX || height > INT_MAX) {
+        return -1;
+    }
+    
+    size->width = width;
+    size->height = height;
+    return 0;
+}
+
+static const char *set_prewarm(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    image_resize_size size;
+    
+    if (parse_size_arg(arg, &size) != 0) {
+        return "ImageResizePrewarm sizes must be of the form WIDTHxHEIGHT";
+    }
+    
+    // The first size registers this directory for the background renders
+    if (!cfg->prewarm_sizes) {
+        cfg->prewarm_sizes = apr_array_make(cmd->pool, 4, sizeof(image_resize_size));
+        APR_ARRAY_PUSH(scfg->prewarm_configs, image_resize_config *) = cfg;
+    }
+    APR_ARRAY_PUSH(cfg->prewarm_sizes, image_resize_size) = size;
+    return NULL;
+}
+
+static const char *set_allowed_sizes(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    image_resize_size size;
+    
+    if (parse_size_arg(arg, &size) != 0) {
+        return "ImageResizeAllowedSizes sizes must be of the form WIDTHxHEIGHT";
+    }
+    
+    if (!cfg->allowed_sizes) {
+        cfg->allowed_sizes = apr_array_make(cmd->pool, 8, sizeof(image_resize_size));
+    }
+    APR_ARRAY_PUSH(cfg->allowed_sizes, image_resize_size) = size;
+    return NULL;
+}
+
+static const char *set_snap_sizes(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    if (strcasecmp(arg, "off") == 0) {
+        cfg->snap_sizes = IMAGE_SNAP_OFF;
+    } else if (strcasecmp(arg, "redirect") == 0) {
+        cfg->snap_sizes = IMAGE_SNAP_REDIRECT;
+    } else if (strcasecmp(arg, "serve") == 0) {
+        cfg->snap_sizes = IMAGE_SNAP_SERVE;
+    } else {
+        return "ImageResizeSnapSizes must be Off, Redirect or Serve";
+    }
+    return NULL;
+}
+
+static const char *set_max_dimension(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    int val = atoi(arg);
+    if (val < 0) {
+        return "ImageResizeMaxDimension must be a positive integer (0 for no limit)";
+    }
+    cfg->max_dimension = val;
+    return NULL;
+}
+
+static const char *set_render_siblings(cmd_parms *cmd, void *conf, int flag) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    cfg->render_siblings = flag;
+    return NULL;
+}
+
+static const char *set_negotiate(cmd_parms *cmd, void *conf, int flag) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    cfg->negotiate = flag;
+    return NULL;
+}
+
+static const char *set_cache_layout(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    if (strcasecmp(arg, "tree") == 0) {
+        cfg->cache_layout = IMAGE_CACHE_LAYOUT_TREE;
+    } else if (strcasecmp(arg, "hashed") == 0) {
+        cfg->cache_layout = IMAGE_CACHE_LAYOUT_HASHED;
+    } else {
+        return "ImageResizeCacheLayout must be tree or hashed";
+    }
+    return NULL;
+}
+
+static const char *set_cache_max_bytes(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_config *cfg = (image_resize_config *)conf;
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    apr_off_t val;
+    char *end;
+    
+    if (apr_strtoff(&val, arg, &end, 10) != APR_SUCCESS || *end || val < 0) {
+        return "ImageResizeCacheMaxBytes must be a positive number of bytes (0 for no limit)";
+    }
+    
+    // The first limit registers this directory for the janitor
+    if (val > 0 && cfg->cache_max_bytes == 0) {
+        APR_ARRAY_PUSH(scfg->janitor_configs, image_resize_config *) = cfg;
+    }
+    cfg->cache_max_bytes = val;
+    return NULL;
+}
+
+static const char *set_max_renders(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int val;
+    
+    if (err) {
+        return err;
+    }
+    val = atoi(arg);
+    if (val < 0) {
+        return "ImageResizeMaxConcurrentRenders must be a positive integer (0 for no limit)";
+    }
+    scfg->max_renders = val;
+    return NULL;
+}
+
+static const char *set_render_queue(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int val;
+    
+    if (err) {
+        return err;
+    }
+    val = atoi(arg);
+    if (val < 0) {
+        return "ImageResizeRenderQueue must be a positive integer";
+    }
+    scfg->render_queue = val;
+    return NULL;
+}
+
+static const char *set_janitor_interval(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int val;
+    
+    if (err) {
+        return err;
+    }
+    val = atoi(arg);
+    if (val <= 0) {
+        return "ImageResizeCacheJanitorInterval must be a positive integer";
+    }
+    scfg->janitor_interval = val;
+    return NULL;
+}
+
+static const char *set_render_queue_timeout(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int val;
+    
+    if (err) {
+        return err;
+    }
+    val = atoi(arg);
+    if (val < 0) {
+        return "ImageResizeRenderQueueTimeout must be a positive integer";
+    }
+    scfg->render_queue_timeout = val;
+    return NULL;
+}
+
+static const char *set_vips_concurrency(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int val;
+    
+    if (err) {
+        return err;
+    }
+    if (strcasecmp(arg, "auto") == 0) {
+        scfg->vips_concurrency_auto = 1;
+        return NULL;
+    }
+    val = atoi(arg);
+    if (val <= 0) {
+        return "ImageResizeVipsConcurrency must be a positive integer or auto";
+    }
+    scfg->vips.concurrency = val;
+    scfg->vips_concurrency_auto = 0;
+    return NULL;
+}
+
+static const char *set_vips_cache_max(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int val;
+    
+    if (err) {
+        return err;
+    }
+    val = atoi(arg);
+    if (val < 0) {
+        return "ImageResizeVipsCacheMax must be a positive integer (0 to disable)";
+    }
+    scfg->vips.cache_max = val;
+    return NULL;
+}
+
+static const char *set_vips_cache_max_mem(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_off_t val;
+    char *end;
+    
+    if (err) {
+        return err;
+    }
+    if (apr_strtoff(&val, arg, &end, 10) != APR_SUCCESS || *end || val < 0) {
+        return "ImageResizeVipsCacheMaxMem must be a positive number of bytes";
+    }
+    scfg->vips.cache_max_mem = val;
+    return NULL;
+}
+
+static const char *set_vips_cache_max_files(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int val;
+    
+    if (err) {
+        return err;
+    }
+    val = atoi(arg);
+    if (val < 0) {
+        return "ImageResizeVipsCacheMaxFiles must be a positive integer";
+    }
+    scfg->vips.cache_max_files = val;
+    return NULL;
+}
+
+static const char *set_vips_leak(cmd_parms *cmd, void *conf, int flag) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    
+    if (err) {
+        return err;
+    }
+    scfg->vips.leak = flag;
+    return NULL;
+}
+
+static const char *set_prewarm_threads(cmd_parms *cmd, void *conf, const char *arg) {
+    image_resize_server_config *scfg = ap_get_module_config(cmd->server->module_config,
+                                                            &image_resize_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int val;
+    
+    if (err) {
+        return err;
+    }
+    val = atoi(arg);
+    if (val <= 0) {
+        return "ImageResizePrewarmThreads must be a positive integer";
+    }
+    scfg->prewarm_threads = val;
+    return NULL;
+}
+
 // Configuration commands table
 static const command_rec image_resize_cmds[] = {
     AP_INIT_TAKE1("ImageResizeSourceDir", set_image_dir, NULL, ACCESS_CONF,
@@ -654,13 +2227,84 @@ static const command_rec image_resize_cmds[] = {
                 "Enable mutex for cache operations (On/Off)"),
     AP_INIT_FLAG("ImageResizeCheckMTime", set_check_source_mtime, NULL, ACCESS_CONF,
                 "Check if source image is newer than cached image (On/Off)"),
+    AP_INIT_TAKE1("ImageResizeMTimeTTL", set_mtime_ttl, NULL, ACCESS_CONF,
+                 "Seconds during which a source modification time checked by ImageResizeCheckMTime is trusted (0 to disable)"),
+    AP_INIT_TAKE1("ImageResizeRenderTimeout", set_render_timeout, NULL, ACCESS_CONF,
+                 "Seconds to wait for a render in progress in another process"),
+    AP_INIT_FLAG("ImageResizeStreamRender", set_stream_render, NULL, ACCESS_CONF,
+                "Send freshly rendered images from memory instead of the cache file (On/Off)"),
+    AP_INIT_TAKE1("ImageResizeMaxPixels", set_max_pixels, NULL, ACCESS_CONF,
+                 "Largest source image accepted, in pixels (0 for no limit)"),
+    AP_INIT_TAKE1("ImageResizeMaxFrames", set_max_frames, NULL, ACCESS_CONF,
+                 "Frames of animated GIF and WebP sources kept in GIF and WebP renders (0 for the first frame only)"),
+    AP_INIT_TAKE1("ImageResizeNegativeCacheTTL", set_negative_cache_ttl, NULL, ACCESS_CONF,
+                 "Seconds during which a missing source image is answered with 404 without any lookup (0 to disable)"),
+    AP_INIT_TAKE1("ImageResizeMemCacheSize", set_mem_cache_size, NULL, RSRC_CONF,
+                 "Size in bytes of the shared memory cache of hot images (0 to disable)"),
+    AP_INIT_ITERATE("ImageResizePrewarm", set_prewarm, NULL, ACCESS_CONF,
+                   "Sizes (WIDTHxHEIGHT) rendered in the background for new and modified source images"),
+    AP_INIT_ITERATE("ImageResizeAllowedSizes", set_allowed_sizes, NULL, ACCESS_CONF,
+                   "Sizes (WIDTHxHEIGHT) that may be requested, any size when not set"),
+    AP_INIT_TAKE1("ImageResizeSnapSizes", set_snap_sizes, NULL, ACCESS_CONF,
+                 "Handling of sizes missing from ImageResizeAllowedSizes: Off (400), Redirect or Serve"),
+    AP_INIT_TAKE1("ImageResizeMaxDimension", set_max_dimension, NULL, ACCESS_CONF,
+                 "Largest width or height that may be requested (0 for no limit)"),
+    AP_INIT_FLAG("ImageResizeRenderSiblings", set_render_siblings, NULL, ACCESS_CONF,
+                "Render the missing ImageResizePrewarm sizes of a source along with a cache miss (On/Off)"),
+    AP_INIT_FLAG("ImageResizeNegotiate", set_negotiate, NULL, ACCESS_CONF,
+                "Serve WebP or AVIF instead of JPEG and PNG to clients accepting them (On/Off)"),
+    AP_INIT_TAKE1("ImageResizeCacheLayout", set_cache_layout, NULL, ACCESS_CONF,
+                 "Layout of the cache directory: tree (mirror of the sources) or hashed"),
+    AP_INIT_TAKE1("ImageResizePNGEffort", set_png_effort, NULL, ACCESS_CONF,
+                 "zlib compression level of PNG renders (0-9)"),
+    AP_INIT_TAKE1("ImageResizeWebPEffort", set_webp_effort, NULL, ACCESS_CONF,
+                 "Encoder effort of WebP renders (0-6)"),
+    AP_INIT_FLAG("ImageResizeJPEGTrellis", set_jpeg_trellis, NULL, ACCESS_CONF,
+                "Trellis quantization of JPEG renders, with mozjpeg (On/Off)"),
+    AP_INIT_FLAG("ImageResizeTwoTierEncode", set_two_tier, NULL, ACCESS_CONF,
+                "Answer cache misses with a fast encode, replaced in the background by a full-effort one (On/Off)"),
+    AP_INIT_FLAG("ImageResizeFastPath", set_fast_path, NULL, ACCESS_CONF,
+                "Serve cache hits with the core file handler, before the image handler (On/Off)"),
+    AP_INIT_TAKE1("ImageResizeCacheMaxBytes", set_cache_max_bytes, NULL, ACCESS_CONF,
+                 "Size budget in bytes of the cache directory, enforced in the background (0 for no limit)"),
+    AP_INIT_TAKE1("ImageResizeCacheJanitorInterval", set_janitor_interval, NULL, RSRC_CONF,
+                 "Seconds between two walks of the cache directories by the janitor"),
+    AP_INIT_TAKE1("ImageResizePrewarmThreads", set_prewarm_threads, NULL, RSRC_CONF,
+                 "Number of background render threads of ImageResizePrewarm"),
+    AP_INIT_TAKE1("ImageResizeMaxConcurrentRenders", set_max_renders, NULL, RSRC_CONF,
+                 "Renders running at once in each child process (0 for no limit)"),
+    AP_INIT_TAKE1("ImageResizeRenderQueue", set_render_queue, NULL, RSRC_CONF,
+                 "Requests of each child process waiting for a render slot before answering 503"),
+    AP_INIT_TAKE1("ImageResizeRenderQueueTimeout", set_render_queue_timeout, NULL, RSRC_CONF,
+                 "Seconds a request waits for a render slot before answering 503"),
+    AP_INIT_TAKE1("ImageResizeVipsConcurrency", set_vips_concurrency, NULL, RSRC_CONF,
+                 "Worker threads of each libvips render, or auto to share the cores between all renders"),
+    AP_INIT_TAKE1("ImageResizeVipsCacheMax", set_vips_cache_max, NULL, RSRC_CONF,
+                 "Operations kept in the libvips operation cache of each child (0 to disable)"),
+    AP_INIT_TAKE1("ImageResizeVipsCacheMaxMem", set_vips_cache_max_mem, NULL, RSRC_CONF,
+                 "Bytes held by the libvips operation cache of each child"),
+    AP_INIT_TAKE1("ImageResizeVipsCacheMaxFiles", set_vips_cache_max_files, NULL, RSRC_CONF,
+                 "Files kept open by the libvips operation cache of each child"),
+    AP_INIT_FLAG("ImageResizeVipsLeak", set_vips_leak, NULL, RSRC_CONF,
+                "Report leaked libvips objects when a child exits (On/Off)"),
     { NULL }
 };
 
 // Register hooks
 static void register_hooks(apr_pool_t *p) {
-    // Handler hook
+    // Handler hooks
     ap_hook_handler(image_resize_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(image_resize_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    
+    // Fast path of cache hits, before the handler and the directory walk
+    ap_hook_translate_name(image_resize_translate, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_map_to_storage(image_resize_map_to_storage, NULL, NULL, APR_HOOK_FIRST);
+    
+    // Log hook - publishes the request timings before mod_log_config formats them
+    ap_hook_log_transaction(image_resize_stats_log, NULL, NULL, APR_HOOK_REALLY_FIRST);
+    
+    // Pre-config hook - registers mutex types
+    ap_hook_pre_config(image_resize_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     
     // Post-config hook - called at server startup
     ap_hook_post_config(image_resize_init, NULL, NULL, APR_HOOK_MIDDLE);
@@ -674,7 +2318,7 @@ module AP_MODULE_DECLARE_DATA image_resize_module = {
     STANDARD20_MODULE_STUFF,
     create_dir_config,       /* create per-dir config structures */
     NULL,                    /* merge per-dir config structures */
-    NULL,                    /* create per-server config structures */
+    create_server_config,    /* create per-server config structures */
     NULL,                    /* merge per-server config structures */
     image_resize_cmds,       /* table of config file commands */
     register_hooks           /* register hooks */
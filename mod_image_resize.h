@@ -19,29 +19,109 @@
 #include <apr_tables.h>
 #include <apr_pools.h>
 #include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <apr_shm.h>
+#include <apr_global_mutex.h>
+#include <apr_portable.h>
+#include <util_mutex.h>
 #include <util_filter.h>
+#include <apr_buckets.h>
 #include <http_request.h>
 
+#include "image_resize_render.h"
+
 // Module declaration
 extern module AP_MODULE_DECLARE_DATA image_resize_module;
 
-// Configuration structure
+// Server-wide configuration structure
 typedef struct {
-    const char *image_dir;       // Source image directory
-    const char *cache_dir;       // Cache directory
-    int quality;                 // Universal image quality (0-100)
-    int cache_max_age;           // Cache lifetime in seconds
-    int enable_mutex;            // Enable cache mutex (0/1)
-    int check_source_mtime;      // Check if source image is newer than cached image (0/1)
-} image_resize_config;
-
-// Request info structure
+    apr_size_t mem_cache_size;   // Size of the shared memory cache of resized images (0 = disabled)
+    apr_array_header_t *prewarm_configs; // Directory configs with ImageResizePrewarm sizes
+    int prewarm_threads;         // Background render threads of the prewarm leader
+    apr_array_header_t *janitor_configs; // Directory configs with ImageResizeCacheMaxBytes
+    int janitor_interval;        // Seconds between two walks of the cache directories
+    int max_renders;             // Concurrent renders of request threads per child (0 = unlimited)
+    int render_queue;            // Requests waiting for a render slot per child
+    int render_queue_timeout;    // Seconds a request waits for a render slot
+    image_vips_tuning vips;      // libvips settings of each child
+    int vips_concurrency_auto;   // Derive vips.concurrency from the MPM and the cores (0/1)
+    int two_tier;                // A directory of the server uses ImageResizeTwoTierEncode (0/1)
+} image_resize_server_config;
+
+// Image found in the shared memory cache
 typedef struct {
-    char* filename;              // Image filename (including path)
-    int width;                   // Target width
-    int height;                  // Target height
-    char* format;                // "jpg", "png", "gif", "webp" or "unknown"
-} image_request;
+    const char* data;            // Encoded bytes, copied into the request pool
+    apr_size_t size;             // Number of bytes
+    const char* content_type;    // Content-Type of the encoded bytes
+    apr_time_t mtime;            // Modification time of the source of the image
+} image_memcache_hit;
+
+// FNV-1a hash of a string, used for lock stripes and cache indexes
+static APR_INLINE apr_uint32_t image_resize_hash_string(const char *str) {
+    apr_uint32_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// 64-bit FNV-1a hash of a string, for indexes trusted without comparing keys
+static APR_INLINE apr_uint64_t image_resize_hash64_string(const char *str) {
+    apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= APR_UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+// Shared memory cache of resized images (image_resize_memcache.c)
+apr_status_t image_resize_memcache_pre_config(apr_pool_t *p);
+apr_status_t image_resize_memcache_create(apr_pool_t *p, server_rec *s, apr_size_t size);
+apr_status_t image_resize_memcache_child_init(apr_pool_t *p, server_rec *s);
+apr_size_t image_resize_memcache_max_size(const char *key);
+int image_resize_memcache_fetch(const char *key, apr_pool_t *pool, image_memcache_hit *hit);
+void image_resize_memcache_store(const char *key, const void *data, apr_size_t size,
+                                 const char *content_type, apr_time_t mtime);
+void image_resize_memcache_stats(apr_uint64_t *hits, apr_uint64_t *misses,
+                                 apr_uint64_t *stores, apr_uint64_t *evictions);
+
+// Render pipeline shared by requests and background renders (mod_image_resize.c)
+const char *image_resize_cache_path(apr_pool_t *p, const image_resize_config *cfg,
+                                    const image_request *req);
+int image_resize_render_cached(const image_render_ctx *ctx, const image_resize_config *cfg,
+                               const image_request *req, const char *cache_path,
+                               image_buffer *rendered);
+int image_resize_render_cached_variants(const image_render_ctx *ctx, const image_resize_config *cfg,
+                                        const char *filename, image_format format,
+                                        const image_resize_size *sizes, int nsizes);
+int image_resize_reencode_cached(const image_render_ctx *ctx, const image_resize_config *cfg,
+                                 const image_request *req, const char *cache_path);
+
+// Background rendering of the ImageResizePrewarm sizes (image_resize_prewarm.c)
+apr_status_t image_resize_prewarm_pre_config(apr_pool_t *p);
+apr_status_t image_resize_prewarm_create(apr_pool_t *p, server_rec *s);
+apr_status_t image_resize_prewarm_child_init(apr_pool_t *p, server_rec *s);
+
+// Cache counters and size limit of the disk cache (image_resize_janitor.c)
+apr_status_t image_resize_janitor_pre_config(apr_pool_t *p);
+apr_status_t image_resize_janitor_create(apr_pool_t *p, server_rec *s);
+apr_status_t image_resize_janitor_child_init(apr_pool_t *p, server_rec *s);
+void image_resize_janitor_record(const char *cache_path, int hit);
+void image_resize_janitor_stats(apr_uint64_t *hits, apr_uint64_t *misses, apr_uint64_t *evictions);
+
+// Full-effort encodes of ImageResizeTwoTierEncode (image_resize_reencode.c)
+apr_status_t image_resize_reencode_child_init(apr_pool_t *p, server_rec *s);
+void image_resize_reencode_enqueue(const image_resize_config *cfg, const image_request *req,
+                                   const char *cache_path);
+
+// Request timings and the image-resize-status handler (image_resize_stats.c)
+apr_status_t image_resize_stats_create(apr_pool_t *p, server_rec *s);
+image_render_timings *image_resize_stats_begin(request_rec *r);
+image_render_timings *image_resize_stats_timings(request_rec *r);
+int image_resize_stats_log(request_rec *r);
+int image_resize_status_handler(request_rec *r);
 
 // Logging macros pour différents niveaux de sévérité
 